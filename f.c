@@ -4,6 +4,8 @@
 #include <v2p.h>
 #include <page.h>
 
+#include "vm_area.h"
+
 /* 
  * You may define macros and other helper functions here
  * You must not declare and use any static/global variables 
@@ -35,303 +37,2101 @@
 #define PTE_SIZE 0x8
 #define PT_SIZE 0x200
 #define ADDR_SHIFT 0xC
-static int range_overlap(u64 s1, u64 e1, u64 s2, u64 e2)
-{
-    return (s1 < e2 && s2 < e1);
-}
+
+#define PTE_PS      0x80                        /* PMD entry maps a 2 MB page */
+#define HUGE_SIZE   (1ULL << PMD_SHIFT)
+#define HUGE_PAGES  PTRS_PER_PT
+
+#define PTE_A       0x20                        /* accessed, set by the MMU */
+
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0x8000                     /* prefault the whole range in mmap */
+#endif
 static u64 pgsizecalc(u64 len) 
 {
     return ((len + 0x1000 - 1) / 0x1000) * 0x1000;
 }
- 
 
-void uPTPp(u64 pfn, u64 pgd_e, u64 pud_e, u64 pmd_e) {
-    u64 a_ptr = (u64)osmap( ( *((u64*)pmd_e) ) >> 12) ;
-    while(a_ptr < (u64)osmap( ( *((u64*)pmd_e) ) >> 12) + PT_SIZE) {
-       
-        if( ( ( ( *((u64*)a_ptr) ) >> 0x3) & 0x1 ) ==  0x1 ) return;
-        a_ptr += PTE_SIZE;
+/*
+ * mmap.h hands the entry points an int length; they check it is positive
+ * and do everything else in 64 bits, so one call may span the whole mmap
+ * window once the length is rounded up to pages, but no more.
+ */
+#define MMAP_AREA_SIZE (MMAP_AREA_END - MMAP_AREA_START)
+
+static int bad_range(u64 addr, u64 length)
+{
+    return length == 0 || length > MMAP_AREA_SIZE || addr + pgsizecalc(length) < addr;
+}
+
+/*
+ * VMA index
+ *
+ * The dummy head that current->vm_area points at is allocated as a
+ * struct vm_index, and every real VMA as a struct vm_node.  Both embed
+ * a struct vm_area as their first member, so the sorted vm_next list
+ * stays valid for anything else in the kernel that walks it.  On top of
+ * the list we keep an AVL tree keyed on vm_start, which lets lookup,
+ * insert, split and merge find their position in O(log n) instead of
+ * walking the list from the head.
+ *
+ * Each node also records the free gap between its predecessor and
+ * itself, and the largest such gap in its subtree (the same idea as
+ * rb_subtree_gap in Linux).  That lets mmap find the lowest hole that
+ * fits without visiting every VMA.
+ */
+struct vm_node {
+    struct vm_area vma;                 /* must stay first */
+    struct vm_node *left;
+    struct vm_node *right;
+    int height;
+    u64 gap;                            /* free bytes right below vm_start */
+    u64 max_gap;                        /* largest gap in this subtree */
+};
+
+/*
+ * Faults tend to land in the VMA that took the previous fault, so a few
+ * recently hit VMAs are cached per context, slotted by 2 MB region the
+ * way Linux's vmacache does.  Slots are flushed whenever a VMA is split,
+ * trimmed or freed.
+ */
+#define VMACACHE_SIZE 4
+
+/*
+ * Split and merge churn would otherwise hit os_alloc/os_free for every
+ * node, so each context keeps its own free list of vm_nodes, refilled a
+ * whole slab at a time.  Free nodes are chained through ->right; the
+ * slabs go back to os_free once the last VMA is unmapped.
+ */
+#define VM_SLAB_BYTES 2048
+
+struct vm_slab {
+    struct vm_slab *next;
+};
+
+#define VM_SLAB_OBJS ((VM_SLAB_BYTES - sizeof(struct vm_slab)) / sizeof(struct vm_node))
+
+/*
+ * Fault-around: a not-present fault also maps the not-present
+ * neighbours inside an aligned window of fa_window pages (same PTE
+ * table, clamped to the VMA).  fa_mask is one bit per page, hence the
+ * 64 page cap; fa_pt keeps the PTE table they are in, so the next fault
+ * reads their accessed bits without a walk.
+ */
+#define FAULT_AROUND_PAGES 16
+#define FAULT_AROUND_MAX   64
+#define FAULT_AROUND_PROBE 64                   /* faults before a collapsed window retries */
+
+#define ZERO_POOL_MAX 32                        /* zeroed frames parked per region */
+#define PFN_BATCH     8                         /* frames a pool refill or trim moves at once */
+
+/* buddy allocator over 2 MB arenas of USER_REG frames, see below; BUDDY_ORDERS is in vm_area.h */
+#define BUDDY_MAX_ORDER (BUDDY_ORDERS - 1)
+#define BUDDY_HASH      16                      /* arena lookup buckets */
+#define BUDDY_IDLE_MAX  2                       /* wholly free arenas kept for reuse */
+
+/* in-kernel trace capture, see vm_area_trace_start */
+#define VM_TRACE_PAGES_MAX 512                  /* ring pages, one directory page of pfns */
+#define VM_TRACE_PER_PAGE  (0x1000 / sizeof(struct vm_trace_rec))
+
+/* munmap/mprotect TLB batching, see tlb_gather below */
+#define TLB_GATHER_PAGES    64                  /* most pages flushed one by one */
+#define TLB_FLUSH_THRESHOLD 33                  /* default, as in Linux */
+
+struct buddy_arena {
+    struct buddy_arena *next;           /* hash chain */
+    u64 base;                           /* first pfn, 2 MB aligned */
+    u64 free_pages;
+    u8 order[HUGE_PAGES];               /* order + 1 if a free block starts here, else 0 */
+};
+
+/* the arenas and their free lists, shared by a context and its cfork children */
+struct buddy_state {
+    u64 sharers;
+    u64 idle;                           /* arenas with every frame free */
+    u64 arenas;
+    u64 free_pages;
+    u64 free_blocks[BUDDY_ORDERS];
+    struct buddy_arena *hash[BUDDY_HASH];
+    u64 head[BUDDY_ORDERS];             /* free blocks per order, by head pfn */
+};
+
+/* the trace ring, shared by a context and its cfork children */
+struct vm_trace {
+    u64 sharers;
+    u64 dir;                            /* OS_DS_REG page holding the ring pages' pfns */
+    u64 pages;
+    u64 head;                           /* records written */
+    u64 tail;                           /* records read */
+    u64 dropped;                        /* found the ring full */
+};
+
+/* what one fault did, filled in on the way */
+struct fault_info {
+    int cls;
+    int pt_levels;
+};
+
+struct vm_index {
+    struct vm_area head;                /* must stay first, this is the dummy node */
+    struct vm_node *root;
+    struct vm_area *vmacache[VMACACHE_SIZE];
+    struct vm_slab *slabs;
+    struct vm_node *free_nodes;
+    struct vm_counters counters;
+    u64 fa_max;                         /* configured fault-around window, pages */
+    u64 fa_window;                      /* current, adaptive window */
+    u64 fa_addr;                        /* window of the last fault-around */
+    u64 fa_mask;                        /* which of its pages were prefetched */
+    u64 fa_pt;                          /* pfn of the PTE table holding them */
+    u64 fa_idle;                        /* faults since the window collapsed */
+    u64 ptc_root;                       /* pfn of the page-table count radix root */
+    u64 tlb_threshold;                  /* pages a gather flushes one by one */
+    u64 zp_head[2];                     /* zeroed frame chains, USER_REG and OS_PT_REG */
+    u64 zp_depth[2];
+    u64 page_zero_op;                   /* PAGE_OPS_* for zeroing and for copying */
+    u64 page_copy_op;
+    u64 page_fill_op;                   /* zeroing for vm_area_zero_pool_refill */
+    u64 zero_pfn;                       /* read-only zero page, 0 until the first read fault */
+    struct buddy_state *buddy;          /* NULL until the first run */
+    u64 fault_stats;                    /* pfn of the struct vm_fault_stats page, 0 before the first fault */
+    struct vm_trace *trace;             /* NULL unless vm_area_trace_start */
+};
+
+#define VM_NODE(v)  ((struct vm_node *)(v))
+
+static struct vm_index *vm_index_of(struct exec_context *current)
+{
+    return (struct vm_index *)current->vm_area;
+}
+
+static u64 rdtsc(void)
+{
+    u32 lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((u64)hi << 32) | lo;
+}
+
+static void cpuid(u32 leaf, u32 sub, u32 *a, u32 *b, u32 *c, u32 *d)
+{
+    asm volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(sub));
+}
+
+/*
+ * Bit n set if PAGE_OPS n can run here.  The vector kernels need the OS
+ * to save that state: OSXSAVE is the only such flag user mode can see
+ * too, so it stands in for CR4.OSFXSR as well, and AVX2 additionally
+ * wants YMM enabled in XCR0.
+ */
+static u64 page_ops_supported(void)
+{
+    u32 a, b, c, d;
+    u64 ops = (1 << PAGE_OPS_LOOP) | (1 << PAGE_OPS_REP) | (1 << PAGE_OPS_NT);
+
+    cpuid(0, 0, &a, &b, &c, &d);
+    u32 max_leaf = a;
+    cpuid(1, 0, &a, &b, &c, &d);
+    if (!(c & (1 << 27)))
+        return ops;
+    if (d & (1 << 26))
+        ops |= 1 << PAGE_OPS_SSE2;
+
+    u32 xcr0_lo, xcr0_hi;
+    asm volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if (max_leaf >= 7 && (xcr0_lo & 0x6) == 0x6) {
+        cpuid(7, 0, &a, &b, &c, &d);
+        if (b & (1 << 5))
+            ops |= 1 << PAGE_OPS_AVX2;
     }
-    *((u64*)pmd_e) &= ~(0x3);
-    a_ptr = (u64)osmap( ( *((u64*)pud_e) ) >> 12) ;
-    while(a_ptr < (u64)osmap( ( *((u64*)pud_e) ) >> 12) + PT_SIZE) {
-        
-        if( ( ( ( *((u64*)a_ptr) ) >> 0x3) & 0x1 ) ==  0x1 ) return;
-        a_ptr += PTE_SIZE;
+    return ops;
+}
+
+/*
+ * Most zeroed and copied pages are used right away (faults, CoW, the
+ * zero page, buddy runs), so both kernels keep the lines in the cache:
+ * rep stosq/movsq when the CPU has fast strings (ERMS), else the widest
+ * vector kernel available.  Only vm_area_zero_pool_refill zeroes frames
+ * that then sit idle, and it writes around the cache.
+ */
+static void page_ops_pick(struct vm_index *idx)
+{
+    u32 a, b, c, d;
+    u64 ops = page_ops_supported();
+
+    idx->page_fill_op = PAGE_OPS_NT;
+    cpuid(0, 0, &a, &b, &c, &d);
+    if (a >= 7) {
+        cpuid(7, 0, &a, &b, &c, &d);
+        if (b & (1 << 9)) {
+            idx->page_zero_op = PAGE_OPS_REP;
+            idx->page_copy_op = PAGE_OPS_REP;
+            return;
+        }
     }
-    *((u64*)pud_e) &= ~(0x3);
-    a_ptr = (u64)osmap( ( *((u64*)pgd_e) ) >> 12) ;
-    while(a_ptr < (u64)osmap( ( *((u64*)pgd_e) ) >> 12) + PT_SIZE) {
-        if( ( ( ( *((u64*)a_ptr) ) >> 0x3) & 0x1 ) ==  0x1 ) return;
-        a_ptr += PTE_SIZE;
-        asm volatile("invlpg (%0);" ::"r"(a_ptr) : "memory");
+    idx->page_zero_op = (ops & (1 << PAGE_OPS_AVX2)) ? PAGE_OPS_AVX2 :
+                        (ops & (1 << PAGE_OPS_SSE2)) ? PAGE_OPS_SSE2 : PAGE_OPS_REP;
+    idx->page_copy_op = idx->page_zero_op;
+}
+
+/* parent is the cforking context's index, NULL for a fresh one */
+static struct vm_index *vm_index_init(struct exec_context *current, struct vm_index *parent)
+{
+    struct vm_index *idx = os_alloc(sizeof(*idx));
+    if (!idx) return NULL;
+    for (u32 i = 0; i < sizeof(*idx); i++)
+        ((char *)idx)[i] = 0;
+    idx->fa_max            = FAULT_AROUND_PAGES;
+    idx->fa_window         = FAULT_AROUND_PAGES;
+    idx->tlb_threshold     = TLB_FLUSH_THRESHOLD;
+    // CPUID traps under a hypervisor: a cfork child takes its parent's pick
+    if (parent) {
+        idx->page_zero_op = parent->page_zero_op;
+        idx->page_copy_op = parent->page_copy_op;
+        idx->page_fill_op = parent->page_fill_op;
+    } else {
+        page_ops_pick(idx);
     }
-    *((u64*)pgd_e) &= ~(0x3);
-    return;
+    idx->head.vm_start     = MMAP_AREA_START;
+    idx->head.vm_end       = MMAP_AREA_START + 0x1000;
+    idx->head.access_flags = 0;
+    current->vm_area = &idx->head;
+    stats->num_vm_area = 1;
+    return idx;
 }
 
-void f_pfn(long addr) {
-    struct exec_context *current = get_current_ctx();
-    u64 pgdIdx = (addr & PGD_MASK) >> PGD_SHIFT;
-    u64 pudIdx = (addr & PUD_MASK) >> PUD_SHIFT;
-    u64 pmdIdx = (addr & PMD_MASK) >> PMD_SHIFT;
-    u64 pteIdx = (addr & PTE_MASK) >> PTE_SHIFT;
+/* set the fault-around window in pages, a power of two up to FAULT_AROUND_MAX; 1 turns it off */
+long vm_area_set_fault_around(struct exec_context *current, u64 pages)
+{
+    struct vm_index *idx = vm_index_of(current);
+    if (pages == 0 || pages > FAULT_AROUND_MAX || (pages & (pages - 1)))
+        return -EINVAL;
+    if (!idx && !(idx = vm_index_init(current, NULL)))
+        return -ENOMEM;
+    idx->fa_max    = pages;
+    idx->fa_window = pages;
+    idx->fa_mask   = 0;
+    return 0;
+}
 
-    u64 pgd_e = ((u64)osmap(current->pgd)) + (pgdIdx)*(PTE_SIZE);
+/* pages munmap/mprotect invalidate one by one before reloading CR3 instead, up to TLB_GATHER_PAGES */
+long vm_area_set_tlb_threshold(struct exec_context *current, u64 pages)
+{
+    struct vm_index *idx = vm_index_of(current);
+    if (pages > TLB_GATHER_PAGES)
+        return -EINVAL;
+    if (!idx && !(idx = vm_index_init(current, NULL)))
+        return -ENOMEM;
+    idx->tlb_threshold = pages;
+    return 0;
+}
 
-    if( ( *((u64*)pgd_e) & 1 ) == 0) {
+/* force the zero (refill included) and copy kernels, PAGE_OPS_*; -EINVAL if this CPU can't run one */
+long vm_area_set_page_ops(struct exec_context *current, u64 zero_op, u64 copy_op)
+{
+    struct vm_index *idx = vm_index_of(current);
+    u64 ops = page_ops_supported();
+    if (zero_op >= PAGE_OPS_NR || copy_op >= PAGE_OPS_NR ||
+        !(ops & (1 << zero_op)) || !(ops & (1 << copy_op)))
+        return -EINVAL;
+    if (!idx && !(idx = vm_index_init(current, NULL)))
+        return -ENOMEM;
+    idx->page_zero_op = zero_op;
+    idx->page_fill_op = zero_op;
+    idx->page_copy_op = copy_op;
+    return 0;
+}
+
+/* per-context VMA counters, NULL until the first mmap; the buddy gauges are read at the call */
+struct vm_counters *vm_area_counters(struct exec_context *current)
+{
+    struct vm_index *idx = vm_index_of(current);
+    if (!idx) return NULL;
+    struct buddy_state *b = idx->buddy;
+    idx->counters.trace_dropped    = idx->trace ? idx->trace->dropped : 0;
+    idx->counters.buddy_arenas     = b ? b->arenas : 0;
+    idx->counters.buddy_free_pages = b ? b->free_pages : 0;
+    for (int k = 0; k < BUDDY_ORDERS; k++)
+        idx->counters.buddy_free_blocks[k] = b ? b->free_blocks[k] : 0;
+    return &idx->counters;
+}
+
+/* per-context fault classes, latencies and table allocations, NULL until the first fault */
+struct vm_fault_stats *vm_area_fault_stats(struct exec_context *current)
+{
+    struct vm_index *idx = vm_index_of(current);
+    return idx && idx->fault_stats ? (struct vm_fault_stats *)osmap(idx->fault_stats) : NULL;
+}
+
+/*
+ * Trace capture
+ *
+ * host/trace.c records the calls a host driver makes by wrapping the
+ * entry points at link time, which can't see a workload running on
+ * gemOS.  For that, vm_area_trace_start gives the context a ring of
+ * OS_DS_REG pages and every mmap, munmap, mprotect, page fault and
+ * cfork it makes appends one struct vm_trace_rec with its arguments and
+ * result, the same fields the host trace keeps.  A cfork child appends
+ * to its parent's ring, so one ring holds the whole process tree in
+ * the order the calls happened.  vm_area_trace_read drains it, oldest
+ * first; a record that finds the ring full is lost and counted in
+ * trace_dropped.  The ring goes when the last context sharing it stops
+ * tracing or exits.
+ */
+static struct vm_trace_rec *vm_trace_slot(struct vm_trace *t, u64 n)
+{
+    n %= t->pages * VM_TRACE_PER_PAGE;
+    u64 pfn = ((u64 *)osmap(t->dir))[n / VM_TRACE_PER_PAGE];
+    return &((struct vm_trace_rec *)osmap(pfn))[n % VM_TRACE_PER_PAGE];
+}
+
+static void vm_trace(struct exec_context *current, u32 op, u64 addr, u64 length, u32 prot, u32 flags, long result)
+{
+    struct vm_index *idx = vm_index_of(current);
+    struct vm_trace *t = idx ? idx->trace : NULL;
+    if (!t) return;
+    if (t->head - t->tail == t->pages * VM_TRACE_PER_PAGE) {
+        t->dropped++;
         return;
     }
+    struct vm_trace_rec *r = vm_trace_slot(t, t->head++);
+    r->op     = op;
+    r->pid    = current->pid;
+    r->addr   = addr;
+    r->length = length;
+    r->prot   = prot;
+    r->flags  = flags;
+    r->result = result;
+}
 
-    u64 pud_e = ((u64)osmap( ( ( *((u64*)pgd_e)  ) >> ADDR_SHIFT) ) ) + (pudIdx)*(PTE_SIZE);
+/* drop this context's share of the ring; the last sharer frees it */
+static void vm_trace_put(struct vm_index *idx)
+{
+    struct vm_trace *t = idx->trace;
+    if (!t) return;
+    idx->trace = NULL;
+    if (--t->sharers) return;
+    u64 *dir = (u64 *)osmap(t->dir);
+    for (u64 i = 0; i < t->pages; i++)
+        os_pfn_free(OS_DS_REG, dir[i]);
+    os_pfn_free(OS_DS_REG, t->dir);
+    os_free(t, sizeof(*t));
+}
 
-    if( ( *((u64*)pud_e) & 1 ) == 0) {
+/* start recording into a ring of pages OS_DS_REG pages, up to VM_TRACE_PAGES_MAX */
+long vm_area_trace_start(struct exec_context *current, u64 pages)
+{
+    struct vm_index *idx = vm_index_of(current);
+    if (pages == 0 || pages > VM_TRACE_PAGES_MAX || (idx && idx->trace))
+        return -EINVAL;
+    if (!idx && !(idx = vm_index_init(current, NULL)))
+        return -ENOMEM;
+
+    struct vm_trace *t = os_alloc(sizeof(*t));
+    if (!t) return -ENOMEM;
+    for (u32 i = 0; i < sizeof(*t); i++)
+        ((char *)t)[i] = 0;
+    t->sharers = 1;
+    idx->trace = t;
+    if (!(t->dir = os_pfn_alloc(OS_DS_REG))) {
+        vm_trace_put(idx);
+        return -ENOMEM;
+    }
+    u64 *dir = (u64 *)osmap(t->dir);
+    for (; t->pages < pages; t->pages++) {
+        if (!(dir[t->pages] = os_pfn_alloc(OS_DS_REG))) {
+            vm_trace_put(idx);
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+/* move up to max records into buf, oldest first; returns how many */
+long vm_area_trace_read(struct exec_context *current, struct vm_trace_rec *buf, u64 max)
+{
+    struct vm_index *idx = vm_index_of(current);
+    struct vm_trace *t = idx ? idx->trace : NULL;
+    long n = 0;
+    if (!t) return -EINVAL;
+    for (; (u64)n < max && t->tail != t->head; n++)
+        buf[n] = *vm_trace_slot(t, t->tail++);
+    return n;
+}
+
+/* stop recording; what the ring still holds is lost once no sharer is left */
+void vm_area_trace_stop(struct exec_context *current)
+{
+    struct vm_index *idx = vm_index_of(current);
+    if (idx) vm_trace_put(idx);
+}
+
+static int vm_node_height(struct vm_node *n)
+{
+    return n ? n->height : 0;
+}
+
+static void vm_node_update(struct vm_node *n)
+{
+    int hl = vm_node_height(n->left), hr = vm_node_height(n->right);
+    n->height = 1 + (hl > hr ? hl : hr);
+    n->max_gap = n->gap;
+    if (n->left && n->left->max_gap > n->max_gap)
+        n->max_gap = n->left->max_gap;
+    if (n->right && n->right->max_gap > n->max_gap)
+        n->max_gap = n->right->max_gap;
+}
+
+static struct vm_node *vm_node_rotate_right(struct vm_node *n)
+{
+    struct vm_node *l = n->left;
+    n->left  = l->right;
+    l->right = n;
+    vm_node_update(n);
+    vm_node_update(l);
+    return l;
+}
+
+static struct vm_node *vm_node_rotate_left(struct vm_node *n)
+{
+    struct vm_node *r = n->right;
+    n->right = r->left;
+    r->left  = n;
+    vm_node_update(n);
+    vm_node_update(r);
+    return r;
+}
+
+static struct vm_node *vm_node_balance(struct vm_node *n)
+{
+    vm_node_update(n);
+    int bf = vm_node_height(n->left) - vm_node_height(n->right);
+    if (bf > 1) {
+        if (vm_node_height(n->left->left) < vm_node_height(n->left->right))
+            n->left = vm_node_rotate_left(n->left);
+        return vm_node_rotate_right(n);
+    }
+    if (bf < -1) {
+        if (vm_node_height(n->right->right) < vm_node_height(n->right->left))
+            n->right = vm_node_rotate_right(n->right);
+        return vm_node_rotate_left(n);
+    }
+    return n;
+}
+
+static struct vm_node *vm_tree_insert(struct vm_node *root, struct vm_node *n)
+{
+    if (!root) {
+        n->left = n->right = NULL;
+        vm_node_update(n);
+        return n;
+    }
+    if (n->vma.vm_start < root->vma.vm_start)
+        root->left = vm_tree_insert(root->left, n);
+    else
+        root->right = vm_tree_insert(root->right, n);
+    return vm_node_balance(root);
+}
+
+static struct vm_node *vm_tree_remove_min(struct vm_node *root, struct vm_node **min)
+{
+    if (!root->left) {
+        *min = root;
+        return root->right;
+    }
+    root->left = vm_tree_remove_min(root->left, min);
+    return vm_node_balance(root);
+}
+
+static struct vm_node *vm_tree_remove(struct vm_node *root, u64 key)
+{
+    if (!root) return NULL;
+    if (key < root->vma.vm_start) {
+        root->left = vm_tree_remove(root->left, key);
+    } else if (key > root->vma.vm_start) {
+        root->right = vm_tree_remove(root->right, key);
+    } else {
+        struct vm_node *l = root->left, *r = root->right, *m;
+        if (!r) return l;
+        r = vm_tree_remove_min(r, &m);
+        m->left  = l;
+        m->right = r;
+        return vm_node_balance(m);
+    }
+    return vm_node_balance(root);
+}
+
+/* recompute the augmented fields on the path from n down to key */
+static void vm_tree_refresh(struct vm_node *n, u64 key)
+{
+    if (!n) return;
+    if (key < n->vma.vm_start)
+        vm_tree_refresh(n->left, key);
+    else if (key > n->vma.vm_start)
+        vm_tree_refresh(n->right, key);
+    vm_node_update(n);
+}
+
+/* lowest VMA with at least len free bytes below it */
+static struct vm_area *vm_tree_first_fit(struct vm_node *n, u64 len)
+{
+    while (n) {
+        if (n->left && n->left->max_gap >= len)
+            n = n->left;
+        else if (n->gap >= len)
+            return &n->vma;
+        else if (n->right && n->right->max_gap >= len)
+            n = n->right;
+        else
+            break;
+    }
+    return NULL;
+}
+
+static struct vm_area *vma_last(struct vm_index *idx)
+{
+    struct vm_node *n = idx->root;
+    if (!n) return &idx->head;
+    while (n->right) n = n->right;
+    return &n->vma;
+}
+
+/* hole between prev and vma, clipped to the mmap window */
+static u64 vma_hole(struct vm_area *prev, struct vm_area *vma)
+{
+    u64 hole_start = prev->vm_end < MMAP_AREA_START ? MMAP_AREA_START : prev->vm_end;
+    u64 hole_end   = vma->vm_start > MMAP_AREA_END ? MMAP_AREA_END : vma->vm_start;
+    return hole_end > hole_start ? hole_end - hole_start : 0;
+}
+
+/* vma's predecessor changed its end, or vma moved its start */
+static void vma_gap_fix(struct vm_index *idx, struct vm_area *prev, struct vm_area *vma)
+{
+    if (!vma) return;
+    VM_NODE(vma)->gap = vma_hole(prev, vma);
+    vm_tree_refresh(idx->root, vma->vm_start);
+}
+
+/* last VMA starting strictly below addr, or the dummy head */
+static struct vm_area *vma_prev(struct vm_index *idx, u64 addr)
+{
+    struct vm_area *best = &idx->head;
+    for (struct vm_node *n = idx->root; n; ) {
+        if (n->vma.vm_start < addr) {
+            best = &n->vma;
+            n = n->right;
+        } else {
+            n = n->left;
+        }
+    }
+    return best;
+}
+
+/* VMA containing addr, or NULL */
+static struct vm_area *vma_find(struct vm_index *idx, u64 addr)
+{
+    struct vm_area *v = vma_prev(idx, addr + 1);
+    if (v == &idx->head || v->vm_end <= addr) return NULL;
+    return v;
+}
+
+static void vmacache_flush(struct vm_index *idx)
+{
+    for (int i = 0; i < VMACACHE_SIZE; i++)
+        idx->vmacache[i] = NULL;
+}
+
+/* vma_find() for the fault path, served from the vmacache when possible */
+static struct vm_area *vma_find_cached(struct vm_index *idx, u64 addr)
+{
+    for (int i = 0; i < VMACACHE_SIZE; i++) {
+        struct vm_area *v = idx->vmacache[i];
+        if (v && v->vm_start <= addr && addr < v->vm_end) {
+            idx->counters.vmacache_hits++;
+            return v;
+        }
+    }
+    idx->counters.vmacache_misses++;
+    struct vm_area *v = vma_find(idx, addr);
+    if (v)
+        idx->vmacache[(addr >> PMD_SHIFT) & (VMACACHE_SIZE - 1)] = v;
+    return v;
+}
+
+/* node whose vm_next is the first VMA ending above addr */
+static struct vm_area *vma_walk_start(struct vm_index *idx, u64 addr)
+{
+    struct vm_area *p = vma_prev(idx, addr);
+    if (p != &idx->head && p->vm_end > addr)
+        p = vma_prev(idx, p->vm_start);
+    return p;
+}
+
+/* every page of [start, end) lies in a writable VMA */
+static int vma_range_writable(struct vm_index *idx, u64 start, u64 end)
+{
+    struct vm_area *v = vma_find(idx, start);
+    while (v && v->vm_start <= start && (v->access_flags & PROT_WRITE)) {
+        if (v->vm_end >= end) return 1;
+        start = v->vm_end;
+        v = v->vm_next;
+    }
+    return 0;
+}
+
+static int vma_overlaps(struct vm_index *idx, u64 start, u64 end)
+{
+    struct vm_area *n = vma_walk_start(idx, start)->vm_next;
+    return n && n->vm_start < end;
+}
+
+static int vm_slab_refill(struct vm_index *idx)
+{
+    struct vm_slab *slab = os_alloc(VM_SLAB_BYTES);
+    if (!slab) return -ENOMEM;
+    slab->next = idx->slabs;
+    idx->slabs = slab;
+
+    struct vm_node *objs = (struct vm_node *)(slab + 1);
+    for (u32 i = 0; i < VM_SLAB_OBJS; i++) {
+        objs[i].right = idx->free_nodes;
+        idx->free_nodes = &objs[i];
+    }
+    idx->counters.vm_nodes_free += VM_SLAB_OBJS;
+    idx->counters.vm_slabs++;
+    return 0;
+}
+
+/* no VMA left, so every node is on the free list: give the slabs back */
+static void vm_slab_release(struct vm_index *idx)
+{
+    while (idx->slabs) {
+        struct vm_slab *slab = idx->slabs;
+        idx->slabs = slab->next;
+        os_free(slab, VM_SLAB_BYTES);
+    }
+    idx->free_nodes = NULL;
+    idx->counters.vm_nodes_free = 0;
+    idx->counters.vm_slabs = 0;
+}
+
+static struct vm_area *vma_alloc(struct vm_index *idx, u64 start, u64 end, u32 flags)
+{
+    if (!idx->free_nodes && vm_slab_refill(idx))
+        return NULL;
+    struct vm_node *n = idx->free_nodes;
+    idx->free_nodes = n->right;
+    idx->counters.vm_nodes_free--;
+    idx->counters.vm_nodes_active++;
+    n->vma.vm_start     = start;
+    n->vma.vm_end       = end;
+    n->vma.access_flags = flags;
+    n->vma.vm_next      = NULL;
+    return &n->vma;
+}
+
+static void vma_free(struct vm_index *idx, struct vm_area *vma)
+{
+    struct vm_node *n = VM_NODE(vma);
+    n->right = idx->free_nodes;
+    idx->free_nodes = n;
+    idx->counters.vm_nodes_active--;
+    idx->counters.vm_nodes_free++;
+}
+
+static void vma_link(struct vm_index *idx, struct vm_area *prev, struct vm_area *vma)
+{
+    vma->vm_next  = prev->vm_next;
+    prev->vm_next = vma;
+    VM_NODE(vma)->gap = vma_hole(prev, vma);
+    idx->root = vm_tree_insert(idx->root, VM_NODE(vma));
+    vma_gap_fix(idx, vma, vma->vm_next);
+    stats->num_vm_area++;
+}
+
+static void vma_unlink(struct vm_index *idx, struct vm_area *prev, struct vm_area *vma)
+{
+    prev->vm_next = vma->vm_next;
+    vmacache_flush(idx);
+    idx->root = vm_tree_remove(idx->root, vma->vm_start);
+    vma_gap_fix(idx, prev, prev->vm_next);
+    stats->num_vm_area--;
+}
+
+/* split vma at addr; vma keeps [vm_start, addr), the returned node gets the rest */
+static struct vm_area *vma_split(struct vm_index *idx, struct vm_area *vma, u64 addr)
+{
+    struct vm_area *tail = vma_alloc(idx, addr, vma->vm_end, vma->access_flags);
+    if (!tail) return NULL;
+    vmacache_flush(idx);
+    vma->vm_end = addr;
+    vma_link(idx, vma, tail);
+    return tail;
+}
+
+/* coalesce neighbours with equal permissions around [start, end) */
+static void vma_merge_range(struct vm_index *idx, u64 start, u64 end)
+{
+    struct vm_area *prev = vma_walk_start(idx, start);
+    if (prev == &idx->head) prev = prev->vm_next;
+    while (prev && prev->vm_next && prev->vm_start <= end) {
+        struct vm_area *next = prev->vm_next;
+        if (prev->vm_end == next->vm_start && prev->access_flags == next->access_flags) {
+            prev->vm_end = next->vm_end;
+            vma_unlink(idx, prev, next);
+            vma_free(idx, next);
+        } else {
+            prev = next;
+        }
+    }
+}
+ 
+
+/*
+ * Page zero/copy kernels
+ *
+ * One 4 KB page each, both pointers page aligned.  The SSE2 and AVX2
+ * kernels borrow xmm0-3 / ymm0-3 and put back what was there, since
+ * nothing saves the interrupted task's vector state around us.  The
+ * non-temporal ones use movnti, which needs no vector registers, and end
+ * with an sfence so the zeroes are visible before the frame is handed out.
+ */
+static void page_zero_rep(u64 *p)
+{
+    u64 n = 0x1000 / sizeof(u64);
+    asm volatile("rep stosq" : "+D"(p), "+c"(n) : "a"(0ULL) : "memory");
+}
+
+static void page_copy_rep(u64 *dst, u64 *src)
+{
+    u64 n = 0x1000 / sizeof(u64);
+    asm volatile("rep movsq" : "+D"(dst), "+S"(src), "+c"(n) : : "memory");
+}
+
+static void page_zero_sse2(u64 *p)
+{
+    u64 save[2], n = 0x1000 / 64;
+    asm volatile("movdqu %%xmm0, (%2)\n\t"
+                 "pxor %%xmm0, %%xmm0\n"
+                 "1:\n\t"
+                 "movdqa %%xmm0, (%0)\n\t"
+                 "movdqa %%xmm0, 16(%0)\n\t"
+                 "movdqa %%xmm0, 32(%0)\n\t"
+                 "movdqa %%xmm0, 48(%0)\n\t"
+                 "add $64, %0\n\t"
+                 "dec %1\n\t"
+                 "jnz 1b\n\t"
+                 "movdqu (%2), %%xmm0"
+                 : "+r"(p), "+r"(n) : "r"(save) : "memory", "cc");
+}
+
+static void page_copy_sse2(u64 *dst, u64 *src)
+{
+    u64 save[8], n = 0x1000 / 64;
+    asm volatile("movdqu %%xmm0, (%3)\n\t"
+                 "movdqu %%xmm1, 16(%3)\n\t"
+                 "movdqu %%xmm2, 32(%3)\n\t"
+                 "movdqu %%xmm3, 48(%3)\n"
+                 "1:\n\t"
+                 "movdqa (%1), %%xmm0\n\t"
+                 "movdqa 16(%1), %%xmm1\n\t"
+                 "movdqa 32(%1), %%xmm2\n\t"
+                 "movdqa 48(%1), %%xmm3\n\t"
+                 "movdqa %%xmm0, (%0)\n\t"
+                 "movdqa %%xmm1, 16(%0)\n\t"
+                 "movdqa %%xmm2, 32(%0)\n\t"
+                 "movdqa %%xmm3, 48(%0)\n\t"
+                 "add $64, %0\n\t"
+                 "add $64, %1\n\t"
+                 "dec %2\n\t"
+                 "jnz 1b\n\t"
+                 "movdqu (%3), %%xmm0\n\t"
+                 "movdqu 16(%3), %%xmm1\n\t"
+                 "movdqu 32(%3), %%xmm2\n\t"
+                 "movdqu 48(%3), %%xmm3"
+                 : "+r"(dst), "+r"(src), "+r"(n) : "r"(save) : "memory", "cc");
+}
+
+static void page_zero_avx2(u64 *p)
+{
+    u64 save[4], n = 0x1000 / 128;
+    asm volatile("vmovdqu %%ymm0, (%2)\n\t"
+                 "vpxor %%ymm0, %%ymm0, %%ymm0\n"
+                 "1:\n\t"
+                 "vmovdqa %%ymm0, (%0)\n\t"
+                 "vmovdqa %%ymm0, 32(%0)\n\t"
+                 "vmovdqa %%ymm0, 64(%0)\n\t"
+                 "vmovdqa %%ymm0, 96(%0)\n\t"
+                 "add $128, %0\n\t"
+                 "dec %1\n\t"
+                 "jnz 1b\n\t"
+                 "vmovdqu (%2), %%ymm0"
+                 : "+r"(p), "+r"(n) : "r"(save) : "memory", "cc");
+}
+
+static void page_copy_avx2(u64 *dst, u64 *src)
+{
+    u64 save[16], n = 0x1000 / 128;
+    asm volatile("vmovdqu %%ymm0, (%3)\n\t"
+                 "vmovdqu %%ymm1, 32(%3)\n\t"
+                 "vmovdqu %%ymm2, 64(%3)\n\t"
+                 "vmovdqu %%ymm3, 96(%3)\n"
+                 "1:\n\t"
+                 "vmovdqa (%1), %%ymm0\n\t"
+                 "vmovdqa 32(%1), %%ymm1\n\t"
+                 "vmovdqa 64(%1), %%ymm2\n\t"
+                 "vmovdqa 96(%1), %%ymm3\n\t"
+                 "vmovdqa %%ymm0, (%0)\n\t"
+                 "vmovdqa %%ymm1, 32(%0)\n\t"
+                 "vmovdqa %%ymm2, 64(%0)\n\t"
+                 "vmovdqa %%ymm3, 96(%0)\n\t"
+                 "add $128, %0\n\t"
+                 "add $128, %1\n\t"
+                 "dec %2\n\t"
+                 "jnz 1b\n\t"
+                 "vmovdqu (%3), %%ymm0\n\t"
+                 "vmovdqu 32(%3), %%ymm1\n\t"
+                 "vmovdqu 64(%3), %%ymm2\n\t"
+                 "vmovdqu 96(%3), %%ymm3"
+                 : "+r"(dst), "+r"(src), "+r"(n) : "r"(save) : "memory", "cc");
+}
+
+static void page_zero_nt(u64 *p)
+{
+    for (u64 i = 0; i < 0x1000 / sizeof(u64); i += 4)
+        asm volatile("movnti %1, (%0)\n\t"
+                     "movnti %1, 8(%0)\n\t"
+                     "movnti %1, 16(%0)\n\t"
+                     "movnti %1, 24(%0)"
+                     : : "r"(p + i), "r"(0ULL) : "memory");
+    asm volatile("sfence" : : : "memory");
+}
+
+static void page_copy_nt(u64 *dst, u64 *src)
+{
+    for (u64 i = 0; i < 0x1000 / sizeof(u64); i++)
+        asm volatile("movnti %1, (%0)" : : "r"(dst + i), "r"(src[i]) : "memory");
+    asm volatile("sfence" : : : "memory");
+}
+
+static void page_zero_with(u64 op, u64 pfn)
+{
+    u64 *p = (u64 *)osmap(pfn);
+    switch (op) {
+    case PAGE_OPS_REP:  page_zero_rep(p);  return;
+    case PAGE_OPS_SSE2: page_zero_sse2(p); return;
+    case PAGE_OPS_AVX2: page_zero_avx2(p); return;
+    case PAGE_OPS_NT:   page_zero_nt(p);   return;
+    }
+    for (u64 i = 0; i < 0x1000 / sizeof(u64); i++)
+        p[i] = 0;
+}
+
+/* idx may be NULL (memory segments), rep is always there */
+static void page_zero(struct vm_index *idx, u64 pfn)
+{
+    page_zero_with(idx ? idx->page_zero_op : PAGE_OPS_REP, pfn);
+}
+
+static void page_copy(struct vm_index *idx, u64 dst_pfn, u64 src_pfn)
+{
+    u64 *dst = (u64 *)osmap(dst_pfn), *src = (u64 *)osmap(src_pfn);
+    switch (idx ? idx->page_copy_op : PAGE_OPS_REP) {
+    case PAGE_OPS_REP:  page_copy_rep(dst, src);  return;
+    case PAGE_OPS_SSE2: page_copy_sse2(dst, src); return;
+    case PAGE_OPS_AVX2: page_copy_avx2(dst, src); return;
+    case PAGE_OPS_NT:   page_copy_nt(dst, src);   return;
+    }
+    for (u64 i = 0; i < 0x1000 / sizeof(u64); i++)
+        dst[i] = src[i];
+}
+
+/*
+ * Buddy allocator
+ *
+ * Runs of 2^order contiguous USER_REG frames, order 0 to 9.  The region
+ * allocator only hands out single frames, so the buddy allocator works
+ * on 2 MB arenas collected by huge_frame_grab() and splits and merges
+ * inside them.  Arenas are found again by pfn >> 9 through a small hash.
+ *
+ * Free blocks are zero except for their head frame's first two words,
+ * which link the per-order free list (next, prev).  A frame handed out
+ * gets a reference the same way frame_alloc gives one, and a frame
+ * whose last put_pfn lands in frame_free comes back here one page at a
+ * time; so a huge page whose pieces were shared after a split still
+ * merges back to order 9 once the last piece is dropped.
+ *
+ * Only free blocks belong to the allocator.  An arena that merges back
+ * to a single order-9 block is kept for the next huge fault or run, up
+ * to BUDDY_IDLE_MAX of them; past that it is dropped on the spot and
+ * its frames go back to os_pfn_free one by one.
+ *
+ * The arenas and free lists live in a struct buddy_state that cfork
+ * shares with the child, so a frame whose last reference goes in either
+ * process merges back into the arena it came from.  A context lets go
+ * of its share when its window empties (or in vm_area_exit), and the
+ * last one out releases every arena, partly free ones included: their
+ * free blocks go back to os_pfn_free, and frames still in use are freed
+ * one by one when their last reference goes.
+ */
+/*
+ * Grab HUGE_PAGES physically contiguous, 2 MB aligned user frames.
+ * os_pfn_alloc only hands out single frames, so collect them one at a
+ * time and keep the run only if it comes out contiguous.  Frames that
+ * don't fit are chained through their first word and given back at the
+ * end.  Returns the first pfn of the run, or 0.
+ */
+static u64 huge_frame_grab(void)
+{
+    u64 run = 0, run_len = 0, spare = 0;
+
+    for (u64 tries = 0; tries < 2 * HUGE_PAGES && run_len < HUGE_PAGES; tries++) {
+        u64 pfn = os_pfn_alloc(USER_REG);
+        if (!pfn) break;
+        if (run_len && pfn == run + run_len) {
+            run_len++;
+            continue;
+        }
+        if (pfn % HUGE_PAGES == 0) {
+            /* a new aligned start, park whatever run we had */
+            while (run_len) {
+                run_len--;
+                *(u64 *)osmap(run + run_len) = spare;
+                spare = run + run_len;
+            }
+            run = pfn;
+            run_len = 1;
+            continue;
+        }
+        *(u64 *)osmap(pfn) = spare;
+        spare = pfn;
+    }
+
+    while (spare) {
+        u64 next = *(u64 *)osmap(spare);
+        os_pfn_free(USER_REG, spare);
+        spare = next;
+    }
+    if (run_len == HUGE_PAGES) {
+        *(u64 *)osmap(run) = 0;
+        return run;
+    }
+    while (run_len) {
+        run_len--;
+        os_pfn_free(USER_REG, run + run_len);
+    }
+    return 0;
+}
+
+static struct buddy_arena **buddy_bucket(struct buddy_state *b, u64 pfn)
+{
+    return &b->hash[(pfn / HUGE_PAGES) % BUDDY_HASH];
+}
+
+static struct buddy_arena *buddy_arena_of(struct vm_index *idx, u64 pfn)
+{
+    if (!idx->buddy) return NULL;
+    struct buddy_arena *a = *buddy_bucket(idx->buddy, pfn);
+    while (a && a->base != (pfn & ~(HUGE_PAGES - 1)))
+        a = a->next;
+    return a;
+}
+
+static void buddy_list_add(struct buddy_state *b, struct buddy_arena *a, u64 pfn, u64 order)
+{
+    u64 *link = (u64 *)osmap(pfn);
+    link[0] = b->head[order];
+    link[1] = 0;
+    if (link[0])
+        ((u64 *)osmap(link[0]))[1] = pfn;
+    b->head[order] = pfn;
+    a->order[pfn - a->base] = order + 1;
+    b->free_blocks[order]++;
+}
+
+static void buddy_list_del(struct buddy_state *b, struct buddy_arena *a, u64 pfn, u64 order)
+{
+    u64 *link = (u64 *)osmap(pfn);
+    if (link[1])
+        ((u64 *)osmap(link[1]))[0] = link[0];
+    else
+        b->head[order] = link[0];
+    if (link[0])
+        ((u64 *)osmap(link[0]))[1] = link[1];
+    link[0] = link[1] = 0;
+    a->order[pfn - a->base] = 0;
+    b->free_blocks[order]--;
+}
+
+/* give the arena's free blocks back frame by frame and forget it */
+static void buddy_arena_release(struct buddy_state *b, struct buddy_arena *a)
+{
+    if (a->free_pages == HUGE_PAGES)
+        b->idle--;
+    for (u64 i = 0; i < HUGE_PAGES; ) {
+        if (!a->order[i]) {
+            i++;
+            continue;
+        }
+        u64 order = a->order[i] - 1;
+        buddy_list_del(b, a, a->base + i, order);
+        for (u64 k = 0; k < (1ULL << order); k++)
+            os_pfn_free(USER_REG, a->base + i + k);
+        b->free_pages -= 1ULL << order;
+        i += 1ULL << order;
+    }
+    struct buddy_arena **pp = buddy_bucket(b, a->base);
+    while (*pp != a)
+        pp = &(*pp)->next;
+    *pp = a->next;
+    os_free(a, sizeof(*a));
+    b->arenas--;
+}
+
+/* drop this context's share of the arenas; the last sharer releases them all */
+static void buddy_put(struct vm_index *idx)
+{
+    struct buddy_state *b = idx->buddy;
+    if (!b) return;
+    idx->buddy = NULL;
+    if (--b->sharers) return;
+    for (int i = 0; i < BUDDY_HASH; i++)
+        while (b->hash[i])
+            buddy_arena_release(b, b->hash[i]);
+    os_free(b, sizeof(*b));
+}
+
+static int buddy_grow(struct vm_index *idx)
+{
+    struct buddy_state *b = idx->buddy;
+    if (!b) {
+        if (!(b = os_alloc(sizeof(*b)))) return 0;
+        for (u32 i = 0; i < sizeof(*b); i++)
+            ((char *)b)[i] = 0;
+        b->sharers = 1;
+        idx->buddy = b;
+    }
+    struct buddy_arena *a = os_alloc(sizeof(*a));
+    if (!a) return 0;
+    u64 base = huge_frame_grab();
+    if (!base) {
+        os_free(a, sizeof(*a));
+        return 0;
+    }
+    for (u64 i = 0; i < HUGE_PAGES; i++)
+        a->order[i] = 0;
+    a->base = base;
+    a->free_pages = HUGE_PAGES;
+    struct buddy_arena **bucket = buddy_bucket(b, base);
+    a->next = *bucket;
+    *bucket = a;
+    buddy_list_add(b, a, base, BUDDY_MAX_ORDER);
+    b->arenas++;
+    b->idle++;
+    b->free_pages += HUGE_PAGES;
+    idx->counters.buddy_grabs++;
+    return 1;
+}
+
+/* 2^order zeroed, contiguous frames, each with one reference, or 0 */
+static u64 buddy_alloc(struct vm_index *idx, u64 order)
+{
+    struct buddy_state *b = idx->buddy;
+    u64 k = order;
+    while (b && k < BUDDY_ORDERS && !b->head[k])
+        k++;
+    if (!b || k == BUDDY_ORDERS) {
+        if (!buddy_grow(idx)) {
+            idx->counters.buddy_alloc_fails++;
+            return 0;
+        }
+        b = idx->buddy;
+        k = BUDDY_MAX_ORDER;
+    }
+
+    u64 pfn = b->head[k];
+    struct buddy_arena *a = buddy_arena_of(idx, pfn);
+    if (a->free_pages == HUGE_PAGES)
+        b->idle--;
+    buddy_list_del(b, a, pfn, k);
+    while (k > order) {
+        k--;
+        buddy_list_add(b, a, pfn + (1ULL << k), k);
+        idx->counters.buddy_splits++;
+    }
+    a->free_pages -= 1ULL << order;
+    b->free_pages -= 1ULL << order;
+    for (u64 i = 0; i < (1ULL << order); i++)
+        if (get_pfn_refcount(pfn + i) == 0) get_pfn(pfn + i);
+    return pfn;
+}
+
+/* pfn heads a zeroed 2^order run inside arena a: merge it back */
+static void buddy_free(struct vm_index *idx, struct buddy_arena *a, u64 pfn, u64 order)
+{
+    struct buddy_state *b = idx->buddy;
+    a->free_pages += 1ULL << order;
+    b->free_pages += 1ULL << order;
+    u64 i = pfn - a->base;
+    while (order < BUDDY_MAX_ORDER) {
+        u64 j = i ^ (1ULL << order);
+        if (a->order[j] != order + 1) break;
+        buddy_list_del(b, a, a->base + j, order);
+        if (j < i) i = j;
+        order++;
+        idx->counters.buddy_merges++;
+    }
+    buddy_list_add(b, a, a->base + i, order);
+
+    if (order == BUDDY_MAX_ORDER && ++b->idle > BUDDY_IDLE_MAX)
+        buddy_arena_release(b, a);
+}
+
+/*
+ * Pre-zeroed frame pool
+ *
+ * USER_REG and OS_PT_REG frames that munmap gives back are zeroed there,
+ * in one batch once the TLB flush is done, and parked with the context
+ * instead of going back to os_pfn_free.  The fault path then takes a
+ * ready frame without touching the allocator.  Parked frames are chained
+ * through their first word, which is cleared again on the way out.
+ *
+ * The pools also act as magazines in front of the region allocator: an
+ * empty one is refilled with PFN_BATCH frames straight from os_pfn_alloc
+ * (as clean as the fault path always took them), and a full one gives
+ * the PFN_BATCH coldest frames back before taking a new one.  gemOS has
+ * no per-CPU storage we could reach without globals, but a context only
+ * runs on one CPU at a time, so the pools need no lock either way.
+ *
+ * Both pools are bounded by ZERO_POOL_MAX and go back to os_pfn_free
+ * when the last VMA is unmapped, so they don't outlive the mappings.
+ * vm_area_zero_pool_refill() tops them up and vm_area_zero_pool_drain()
+ * empties them early; both are meant for idle time.
+ */
+static int zero_pool_slot(u32 region)
+{
+    return region == USER_REG ? 0 : region == OS_PT_REG ? 1 : -1;
+}
+
+static void zero_pool_park(struct vm_index *idx, int slot, u64 pfn)
+{
+    *(u64 *)osmap(pfn) = idx->zp_head[slot];
+    idx->zp_head[slot] = pfn;
+    idx->zp_depth[slot]++;
+    idx->counters.zero_pool_depth++;
+}
+
+static void zero_pool_push(struct vm_index *idx, int slot, u64 pfn, u64 op)
+{
+    page_zero_with(op, pfn);
+    zero_pool_park(idx, slot, pfn);
+    idx->counters.zero_pool_zeroed++;
+}
+
+static u64 zero_pool_pop(struct vm_index *idx, int slot)
+{
+    u64 pfn = idx->zp_head[slot];
+    u64 *p = (u64 *)osmap(pfn);
+    idx->zp_head[slot] = *p;
+    *p = 0;
+    idx->zp_depth[slot]--;
+    idx->counters.zero_pool_depth--;
+    return pfn;
+}
+
+/* empty pool: park up to PFN_BATCH fresh frames, returns how many */
+static u64 zero_pool_fill(struct vm_index *idx, int slot, u32 region)
+{
+    u64 n = 0;
+    while (n < PFN_BATCH) {
+        u64 pfn = os_pfn_alloc(region);
+        if (!pfn) break;
+        zero_pool_park(idx, slot, pfn);
+        n++;
+    }
+    if (n) {
+        idx->counters.zero_pool_refills++;
+        idx->counters.zero_pool_refill_frames += n;
+    }
+    return n;
+}
+
+/* full pool: keep the most recently parked frames, give the rest back */
+static void zero_pool_trim(struct vm_index *idx, int slot, u32 region)
+{
+    u64 keep = idx->zp_depth[slot] > PFN_BATCH ? idx->zp_depth[slot] - PFN_BATCH : 0;
+    u64 *link = &idx->zp_head[slot];
+    for (u64 i = 0; i < keep; i++)
+        link = (u64 *)osmap(*link);
+
+    u64 pfn = *link, n = 0;
+    *link = 0;
+    while (pfn) {
+        u64 next = *(u64 *)osmap(pfn);
+        *(u64 *)osmap(pfn) = 0;
+        os_pfn_free(region, pfn);
+        pfn = next;
+        n++;
+    }
+    idx->zp_depth[slot] -= n;
+    idx->counters.zero_pool_depth -= n;
+    idx->counters.zero_pool_trims++;
+    idx->counters.zero_pool_trim_frames += n;
+}
+
+/* os_pfn_alloc, served from the zeroed pool when it can be */
+static u64 frame_alloc(struct vm_index *idx, u32 region)
+{
+    int slot = zero_pool_slot(region);
+    if (!idx || slot < 0)
+        return os_pfn_alloc(region);
+    if (idx->zp_head[slot]) {
+        idx->counters.zero_pool_hits++;
+    } else {
+        idx->counters.zero_pool_misses++;
+        if (!zero_pool_fill(idx, slot, region))
+            return 0;
+    }
+    u64 pfn = zero_pool_pop(idx, slot);
+    // parked at refcount 0 after the last put_pfn; hand it out like os_pfn_alloc does
+    if (get_pfn_refcount(pfn) == 0) get_pfn(pfn);
+    return pfn;
+}
+
+/* pfn is mapped nowhere any more: zero and park it, or give it back */
+static void frame_free(struct vm_index *idx, u32 region, u64 pfn)
+{
+    int slot = zero_pool_slot(region);
+    if (!idx || slot < 0) {
+        os_pfn_free(region, pfn);
+        return;
+    }
+    struct buddy_arena *a = region == USER_REG ? buddy_arena_of(idx, pfn) : NULL;
+    if (a) {
+        page_zero(idx, pfn);
+        buddy_free(idx, a, pfn, 0);
         return;
     }
+    if (idx->zp_depth[slot] >= ZERO_POOL_MAX)
+        zero_pool_trim(idx, slot, region);
+    zero_pool_push(idx, slot, pfn, idx->page_zero_op);
+}
+
+/* fill both pools up to frames each (at most ZERO_POOL_MAX); returns how many were added */
+long vm_area_zero_pool_refill(struct exec_context *current, u64 frames)
+{
+    struct vm_index *idx = vm_index_of(current);
+    u32 regions[2] = { USER_REG, OS_PT_REG };
+    long added = 0;
+    if (!idx) return -EINVAL;
+    if (frames > ZERO_POOL_MAX) frames = ZERO_POOL_MAX;
+
+    for (int slot = 0; slot < 2; slot++) {
+        while (idx->zp_depth[slot] < frames) {
+            u64 pfn = os_pfn_alloc(regions[slot]);
+            if (!pfn) return added;
+            zero_pool_push(idx, slot, pfn, idx->page_fill_op);
+            added++;
+        }
+    }
+    return added;
+}
+
+/*
+ * Shared zero page
+ *
+ * A read fault on memory nobody has written maps this one frame read-only
+ * instead of a fresh one; the first write goes through handle_cow_fault,
+ * which swaps in a real frame.  There are no globals, so the frame
+ * belongs to the context: the index holds the only reference, and cfork
+ * hands the child the same frame with a reference of its own.  PTEs on
+ * it are counted in zero_page_maps and take no reference (a refcount is
+ * an s8, and one fault-around maps the zero page 16 times), so every
+ * get_pfn/put_pfn on a mapped frame skips zero_pfn.  The frame goes back
+ * once the window is empty.
+ */
+static u64 zero_page_get(struct vm_index *idx)
+{
+    if (!idx->zero_pfn) {
+        u64 pfn = frame_alloc(idx, USER_REG);
+        if (!pfn) return 0;
+        page_zero(idx, pfn);
+        idx->zero_pfn = pfn;
+    }
+    idx->counters.zero_page_maps++;
+    return idx->zero_pfn;
+}
+
+/* drop the index's own reference once nothing maps the zero page any more */
+static void zero_page_put(struct vm_index *idx)
+{
+    if (!idx->zero_pfn || idx->counters.zero_page_maps) return;
+    put_pfn(idx->zero_pfn);
+    if (get_pfn_refcount(idx->zero_pfn) == 0)
+        os_pfn_free(USER_REG, idx->zero_pfn);
+    idx->zero_pfn = 0;
+}
+
+static void zero_pool_release(struct vm_index *idx, u32 region)
+{
+    int slot = zero_pool_slot(region);
+    while (idx->zp_head[slot])
+        os_pfn_free(region, zero_pool_pop(idx, slot));
+}
+
+void vm_area_zero_pool_drain(struct exec_context *current)
+{
+    struct vm_index *idx = vm_index_of(current);
+    if (!idx) return;
+    zero_pool_release(idx, USER_REG);
+    zero_pool_release(idx, OS_PT_REG);
+    zero_page_put(idx);
+}
+
+/*
+ * Page-table entry counts
+ *
+ * Every PMD and PTE table under the mmap window carries the number of its
+ * present entries and how many of those are writable, so "is this table
+ * empty" and "does anything below still need W" are O(1) instead of a
+ * 512-entry scan.  The counts sit in a side array indexed by the table's
+ * pfn; with no global state to hang it off, each vm_index keeps its own
+ * as a three-level radix of OS_DS_REG pages, grown as tables are
+ * allocated and freed when the last VMA is unmapped, by which time munmap
+ * has reclaimed every counted table.  The window is 1 GB aligned, so PUD and PGD tables are the
+ * only ones it shares with the memory segments; their entries change
+ * behind our back and are not counted.
+ *
+ * A PTE table shared after cfork is counted in every sharer.  When one of
+ * them unshares, the W bits it strips from the old table are not seen by
+ * the others, whose writable count then stays high.  That only ever
+ * leaves an upper W bit set, which the PTEs still override.
+ */
+#define PTC_LEAF_BITS 10                        /* struct pt_count per page */
+#define PTC_DIR_BITS  9                         /* page pointers per page */
+#define PTC_MAX_PFN   (1ULL << (PTC_LEAF_BITS + 2 * PTC_DIR_BITS))
+
+struct pt_count {
+    u16 present;
+    u16 writable;
+};
+
+static struct pt_count *pt_count_of(struct vm_index *idx, u64 pfn, int create)
+{
+    if (!idx || pfn >= PTC_MAX_PFN) return NULL;
+    u64 *slot = &idx->ptc_root;
+    for (int level = 0; ; level++) {
+        if (!*slot) {
+            if (!create) return NULL;
+            *slot = os_pfn_alloc(OS_DS_REG);
+            if (!*slot) return NULL;
+        }
+        if (level == 2) break;
+        u64 shift = PTC_LEAF_BITS + (1 - level) * PTC_DIR_BITS;
+        slot = &((u64 *)osmap(*slot))[(pfn >> shift) & ((1ULL << PTC_DIR_BITS) - 1)];
+    }
+    return &((struct pt_count *)osmap(*slot))[pfn & ((1ULL << PTC_LEAF_BITS) - 1)];
+}
+
+/* free the radix; a table still around afterwards just reads as uncounted */
+static void pt_count_release(struct vm_index *idx)
+{
+    if (!idx->ptc_root) return;
+    u64 *root = (u64 *)osmap(idx->ptc_root);
+    for (u64 i = 0; i < (1ULL << PTC_DIR_BITS); i++) {
+        if (!root[i]) continue;
+        u64 *dir = (u64 *)osmap(root[i]);
+        for (u64 j = 0; j < (1ULL << PTC_DIR_BITS); j++)
+            if (dir[j]) os_pfn_free(OS_DS_REG, dir[j]);
+        os_pfn_free(OS_DS_REG, root[i]);
+    }
+    os_pfn_free(OS_DS_REG, idx->ptc_root);
+    idx->ptc_root = 0;
+}
+
+/* a fresh, empty table for the mmap window; counted says whether it is a PMD or PTE table */
+static u64 pt_table_alloc(struct vm_index *idx, int counted)
+{
+    u64 pfn = frame_alloc(idx, OS_PT_REG);
+    if (!pfn || !idx) return pfn;
+    if (counted) {
+        struct pt_count *c = pt_count_of(idx, pfn, 1);
+        if (!c) {
+            frame_free(idx, OS_PT_REG, pfn);
+            return 0;
+        }
+        c->present  = 0;
+        c->writable = 0;
+    }
+    idx->counters.pt_pages_live++;
+    return pfn;
+}
+
+/* the table is no longer ours: forget its counts */
+static void pt_count_drop(struct vm_index *idx, u64 pfn)
+{
+    struct pt_count *c = pt_count_of(idx, pfn, 0);
+    if (c) {
+        c->present  = 0;
+        c->writable = 0;
+    }
+}
+
+#define PTE_RW_PRESENT(e) (((e) & 0x9) == 0x9)
+
+/* store val in entry e of the counted table pt_pfn */
+static void pt_entry_set(struct vm_index *idx, u64 pt_pfn, u64 *e, u64 val)
+{
+    struct pt_count *c = pt_count_of(idx, pt_pfn, 0);
+    if (c) {
+        c->present  += (val & 1) - (*e & 1);
+        c->writable += PTE_RW_PRESENT(val) - PTE_RW_PRESENT(*e);
+    }
+    *e = val;
+}
+
+static int pt_count_writable(struct vm_index *idx, u64 pt_pfn)
+{
+    struct pt_count *c = pt_count_of(idx, pt_pfn, 0);
+    return !c || c->writable;
+}
+
+/*
+ * Page-table range walker
+ *
+ * Descends each table once for the whole [start, end) range and skips
+ * non-present PGD/PUD/PMD entries at their natural 512 GB/1 GB/2 MB
+ * granularity, so a sparsely populated range costs a handful of reads
+ * instead of a full 4-level walk per 4 KB page.  pte_fn is called for
+ * every present PTE; entry[] holds the PGD/PUD/PMD entries leading to it.
+ *
+ * A 2 MB leaf that the range covers completely goes to huge_fn.  One the
+ * range only partly covers is first split into a PTE table and then
+ * walked like any other.  Every walker modifies the PTEs it visits, so a
+ * PTE table still shared after cfork is unshared before descending into
+ * it (or, with drop_shared, released when the range covers all of it).
+ * With reclaim, PMD and PTE tables left empty on the way back up are
+ * freed.
+ *
+ * Walkers that build tables rather than edit them (MAP_POPULATE, cfork)
+ * also set table_fn.  It sees every PGD/PUD/PMD entry in the range
+ * first, present or not, and returns 1 when it has dealt with the entry
+ * itself, 0 to let the walk carry on as above, or -errno to stop it.
+ * With all_ptes, pte_fn gets the non-present PTEs too.
+ */
+#define PT_LEVEL_SHIFT(level) (PGD_SHIFT - 9 * (level))
+
+struct pt_walk {
+    struct exec_context *ctx;
+    struct vm_index *idx;
+    void (*pte_fn)(struct pt_walk *w, u64 *pte, u64 addr);
+    void (*huge_fn)(struct pt_walk *w, u64 *pmd, u64 addr);
+    int (*table_fn)(struct pt_walk *w, int level, u64 *e, u64 addr, u64 next);
+    u64 *entry[3];
+    int prot;
+    int err;
+    int drop_shared;
+    int reclaim;
+    int all_ptes;
+    int share_tables;
+    struct tlb_gather *tlb;
+    struct vm_index *dst_idx;           /* cfork: the child's index, NULL for the segments */
+    u64 dst[4];                         /* cfork: the child's tables on the current path */
+};
+
+/*
+ * TLB maintenance
+ *
+ * Every invalidation goes through tlb_flush_page/tlb_flush_all so it is
+ * counted.  munmap and mprotect don't call them per page: they queue the
+ * addresses in a struct tlb_gather on their stack, together with the
+ * frames that may only be freed once no TLB entry can reach them any
+ * more.  tlb_gather_flush then issues one invlpg per queued page, or a
+ * single CR3 reload once more than tlb_threshold pages piled up.
+ */
+/* the privileged instructions themselves; host/include/page.h swaps in counters */
+#ifndef arch_invlpg
+#define arch_invlpg(addr) asm volatile("invlpg (%0);" ::"r"(addr) : "memory")
+#endif
+#ifndef arch_flush_tlb
+#define arch_flush_tlb() do {                                               \
+        u64 cr3;                                                            \
+        asm volatile("mov %%cr3, %0; mov %0, %%cr3;" : "=r"(cr3) : : "memory"); \
+    } while (0)
+#endif
+
+static void tlb_flush_page(struct vm_index *idx, u64 addr)
+{
+    arch_invlpg(addr);
+    if (idx) idx->counters.tlb_invlpg++;
+}
+
+/* drop every non-global TLB entry by reloading CR3 */
+static void tlb_flush_all(struct vm_index *idx)
+{
+    arch_flush_tlb();
+    if (idx) idx->counters.tlb_full_flushes++;
+}
+
+struct tlb_gather {
+    struct vm_index *idx;
+    u64 nr_pages;                       /* queued, may exceed what addr[] holds */
+    u64 addr[TLB_GATHER_PAGES];
+    u64 free_user;                      /* USER_REG frames to free, chained */
+    u64 free_pt;                        /* OS_PT_REG frames to free, chained */
+};
+
+static void tlb_gather_init(struct tlb_gather *tlb, struct vm_index *idx)
+{
+    tlb->idx       = idx;
+    tlb->nr_pages  = 0;
+    tlb->free_user = 0;
+    tlb->free_pt   = 0;
+}
+
+static void tlb_free_chain(struct vm_index *idx, u32 region, u64 pfn)
+{
+    while (pfn) {
+        u64 next = *(u64 *)osmap(pfn) >> ADDR_SHIFT;
+        frame_free(idx, region, pfn);
+        pfn = next;
+    }
+}
+
+static void tlb_gather_flush(struct tlb_gather *tlb)
+{
+    if (tlb->nr_pages > tlb->idx->tlb_threshold) {
+        tlb_flush_all(tlb->idx);
+    } else {
+        for (u64 i = 0; i < tlb->nr_pages; i++)
+            tlb_flush_page(tlb->idx, tlb->addr[i]);
+    }
+    tlb->nr_pages = 0;
+
+    tlb_free_chain(tlb->idx, USER_REG, tlb->free_user);
+    tlb_free_chain(tlb->idx, OS_PT_REG, tlb->free_pt);
+    tlb->free_user = 0;
+    tlb->free_pt   = 0;
+}
+
+/* addr needs invalidating before the gather is finished */
+static void tlb_gather_page(struct tlb_gather *tlb, u64 addr)
+{
+    if (tlb->nr_pages < TLB_GATHER_PAGES)
+        tlb->addr[tlb->nr_pages] = addr;
+    tlb->nr_pages++;
+}
+
+/*
+ * Free pfn once the TLB can no longer reach it.  The frame itself links
+ * the list, so there is no limit forcing an early flush.  The link is
+ * stored like a non-present entry, in case pfn is a page table the MMU
+ * could still walk.
+ */
+static void tlb_gather_free(struct tlb_gather *tlb, u32 region, u64 pfn)
+{
+    u64 *head = region == OS_PT_REG ? &tlb->free_pt : &tlb->free_user;
+    *(u64 *)osmap(pfn) = *head << ADDR_SHIFT;
+    *head = pfn;
+}
+
+/* the PTE table behind the last fault-around is going away or being replaced */
+static void fault_around_forget(struct vm_index *idx, u64 pt_pfn)
+{
+    if (idx && idx->fa_pt == pt_pfn)
+        idx->fa_mask = 0;
+}
+
+/*
+ * Shared PTE tables
+ *
+ * cfork hands the child the parent's PTE tables as they are: both PMD
+ * entries point at the same table frame, lose their W bit, and the frame
+ * gets one reference per sharer.  The PTEs inside are left alone, the
+ * cleared PMD W bit is what write-protects them.  Whoever changes a PTE
+ * in such a table first takes a private copy; the frames it maps then
+ * sit in two tables, so each gains a reference and loses W in both.
+ */
+static int pt_table_shared(u64 *pmd)
+{
+    return !(*pmd & PTE_PS) && get_pfn_refcount(*pmd >> ADDR_SHIFT) > 1;
+}
+
+static u64 pt_table_present(u64 *pt)
+{
+    u64 n = 0;
+    for (u64 i = 0; i < PTRS_PER_PT; i++)
+        n += pt[i] & 1;
+    return n;
+}
+
+/* idx is NULL for a table under the memory segments, which is not counted */
+static int pt_unshare(struct vm_index *idx, u64 pmd_pfn, u64 *pmd)
+{
+    u64 old_pfn = *pmd >> ADDR_SHIFT;
+    u64 new_pfn = pt_table_alloc(idx, 1);
+    if (!new_pfn) return -ENOMEM;
+
+    u64 *src = (u64 *)osmap(old_pfn), *dst = (u64 *)osmap(new_pfn);
+    struct pt_count *c = pt_count_of(idx, new_pfn, 0);
+    for (u64 i = 0; i < PTRS_PER_PT; i++) {
+        if (src[i] & 1) {
+            src[i] &= ~(u64)0x8;
+            if (!idx || (src[i] >> ADDR_SHIFT) != idx->zero_pfn) get_pfn(src[i] >> ADDR_SHIFT);
+            if (c) c->present++;
+        }
+        dst[i] = src[i];
+    }
+    put_pfn(old_pfn);
+    pt_count_drop(idx, old_pfn);
+    fault_around_forget(idx, old_pfn);
+    if (idx) idx->counters.pt_pages_live--;
+    // private now, the PTEs alone decide what is writable
+    pt_entry_set(idx, pmd_pfn, pmd, (new_pfn << ADDR_SHIFT) | (*pmd & 0xFFF) | 0x8);
+    return 0;
+}
+
+/*
+ * munmap: the PUD, PMD or PTE table under e (an entry at level 0, 1 or 2)
+ * has no present entries left, so free it and clear e.  A PUD table also
+ * holds the memory segments' entries, which bypass the counts, so it is
+ * only freed once a scan finds nothing at all in it; with any segment
+ * in the same 512 GB that stops at the first entry.
+ */
+static int pt_table_empty(u64 *pt)
+{
+    for (u64 i = 0; i < PTRS_PER_PT; i++)
+        if (pt[i] & 1) return 0;
+    return 1;
+}
+
+static void pt_reclaim(struct pt_walk *w, int level, u64 *e, u64 addr)
+{
+    u64 pfn = *e >> ADDR_SHIFT;
+    if (get_pfn_refcount(pfn) > 1) return;
+    if (level == 0) {
+        if (!pt_table_empty((u64 *)osmap(pfn))) return;
+    } else {
+        struct pt_count *c = pt_count_of(w->idx, pfn, 0);
+        if (!c || c->present) return;
+    }
+
+    pt_count_drop(w->idx, pfn);
+    fault_around_forget(w->idx, pfn);
+    if (level == 2)
+        pt_entry_set(w->idx, *w->entry[1] >> ADDR_SHIFT, e, 0x0);
+    else
+        *e = 0x0;
+    // the invlpg also drops paging-structure cache entries pointing at it
+    tlb_gather_page(w->tlb, addr);
+    tlb_gather_free(w->tlb, OS_PT_REG, pfn);
+
+    w->idx->counters.pt_pages_live--;
+    w->idx->counters.pt_pages_reclaimed++;
+}
+
+/* munmap of a whole 2 MB slot: just give our reference on the table back */
+static void pt_drop_shared(struct pt_walk *w, u64 *pmd, u64 addr)
+{
+    u64 *pt = (u64 *)osmap(*pmd >> ADDR_SHIFT);
+    for (u64 i = 0; i < PTRS_PER_PT; i++) {
+        if (!(pt[i] & 1)) continue;
+        w->idx->counters.small_pages--;
+        if ((pt[i] >> ADDR_SHIFT) == w->idx->zero_pfn) w->idx->counters.zero_page_maps--;
+        tlb_gather_page(w->tlb, addr + (i << PTE_SHIFT));
+    }
+    put_pfn(*pmd >> ADDR_SHIFT);
+    pt_count_drop(w->idx, *pmd >> ADDR_SHIFT);
+    fault_around_forget(w->idx, *pmd >> ADDR_SHIFT);
+    w->idx->counters.pt_pages_live--;
+    pt_entry_set(w->idx, *w->entry[1] >> ADDR_SHIFT, pmd, 0x0);
+}
+
+/* replace a 2 MB leaf with a PTE table mapping the same frames */
+static int pmd_split_huge(struct pt_walk *w, u64 *pmd, u64 addr)
+{
+    u64 pt_pfn = pt_table_alloc(w->idx, 1);
+    if (!pt_pfn) return -ENOMEM;
+
+    u64 base  = *pmd >> ADDR_SHIFT;
+    u64 flags = *pmd & 0xFFF & ~(u64)PTE_PS;
+    u64 *pte  = (u64 *)osmap(pt_pfn);
+    for (u64 i = 0; i < HUGE_PAGES; i++)
+        pte[i] = ((base + i) << ADDR_SHIFT) | flags;
+    struct pt_count *c = pt_count_of(w->idx, pt_pfn, 0);
+    if (c) {
+        c->present  = HUGE_PAGES;
+        c->writable = (flags & 0x8) ? HUGE_PAGES : 0;
+    }
+
+    *pmd = (pt_pfn << ADDR_SHIFT) | 0x1 | 0x10 | (flags & 0x8);
+    if (w->tlb) tlb_gather_page(w->tlb, addr);
+    else tlb_flush_page(w->idx, addr);
+
+    w->idx->counters.huge_pages--;
+    w->idx->counters.huge_splits++;
+    w->idx->counters.small_pages += HUGE_PAGES;
+    return 0;
+}
+
+/* pfn of the table the walk is in at level */
+static u64 pt_walk_table(struct pt_walk *w, int level)
+{
+    return level ? *w->entry[level - 1] >> ADDR_SHIFT : w->ctx->pgd;
+}
+
+static void pt_walk_level(struct pt_walk *w, u64 *table, int level, u64 start, u64 end)
+{
+    int shift = PT_LEVEL_SHIFT(level);
+    u64 addr = start;
+    while (addr < end) {
+        u64 next = ((addr >> shift) + 1) << shift;
+        if (next > end || next < addr)
+            next = end;
+        u64 *e = &table[(addr >> shift) & (PTRS_PER_PT - 1)];
+        if (level < 3) {
+            w->entry[level] = e;
+            int r = w->table_fn ? w->table_fn(w, level, e, addr, next) : 0;
+            if (r < 0) {
+                w->err = r;
+                return;
+            }
+            if (r) {
+                addr = next;
+                continue;
+            }
+        }
+        if ((*e & 1) && level == 2 && (*e & PTE_PS)) {
+            if (w->huge_fn && addr == (addr & ~(HUGE_SIZE - 1)) && next - addr == HUGE_SIZE) {
+                w->huge_fn(w, e, addr);
+                addr = next;
+                continue;
+            }
+            if (pmd_split_huge(w, e, addr)) {
+                w->err = -ENOMEM;
+                return;
+            }
+        }
+        // only the mmap window (idx set) has shared tables
+        if (w->idx && (*e & 1) && level == 2 && pt_table_shared(e)) {
+            if (w->drop_shared && next - addr == HUGE_SIZE) {
+                pt_drop_shared(w, e, addr);
+                addr = next;
+                continue;
+            }
+            if (pt_unshare(w->idx, *w->entry[1] >> ADDR_SHIFT, e)) {
+                w->err = -ENOMEM;
+                return;
+            }
+        }
+        if (level == 3) {
+            if ((*e & 1) || w->all_ptes) {
+                w->pte_fn(w, e, addr);
+                if (w->err) return;
+            }
+        } else if (*e & 1) {
+            pt_walk_level(w, (u64 *)osmap(*e >> ADDR_SHIFT), level + 1, addr, next);
+            if (w->err) return;
+            if (w->reclaim)
+                pt_reclaim(w, level, e, addr);
+        }
+        addr = next;
+    }
+}
+
+static int pt_walk_range(struct pt_walk *w, u64 start, u64 end)
+{
+    pt_walk_level(w, (u64 *)osmap(w->ctx->pgd), 0, start & ~(u64)0xFFF, end);
+    return w->err;
+}
+
+/*
+ * Parked pool frames sit in the middle of otherwise free runs, so when
+ * the first attempt fails hand the USER_REG pool back and try once more.
+ */
+static u64 run_alloc(struct vm_index *idx, u64 order)
+{
+    u64 pfn = buddy_alloc(idx, order);
+    if (pfn || !idx->zp_depth[0])
+        return pfn;
+    zero_pool_release(idx, USER_REG);
+    return buddy_alloc(idx, order);
+}
+
+static u64 huge_frame_alloc(struct vm_index *idx)
+{
+    return idx ? run_alloc(idx, BUDDY_MAX_ORDER) : huge_frame_grab();
+}
+
+/* 2^order contiguous, zeroed USER_REG frames for the caller to map; 0 if none */
+u64 vm_area_alloc_run(struct exec_context *current, u64 order)
+{
+    struct vm_index *idx = vm_index_of(current);
+    if (!idx || order >= BUDDY_ORDERS) return 0;
+    return run_alloc(idx, order);
+}
+
+/* give back a run from vm_area_alloc_run, dropping one reference per frame */
+long vm_area_free_run(struct exec_context *current, u64 pfn, u64 order)
+{
+    struct vm_index *idx = vm_index_of(current);
+    if (!idx || order >= BUDDY_ORDERS || (pfn & ((1ULL << order) - 1)))
+        return -EINVAL;
+
+    // the common case, nobody else holds any of it: merge it back whole
+    struct buddy_arena *a = buddy_arena_of(idx, pfn);
+    u64 i = 0;
+    while (a && i < (1ULL << order) && get_pfn_refcount(pfn + i) == 1)
+        i++;
+    if (a && i == (1ULL << order)) {
+        for (i = 0; i < (1ULL << order); i++) {
+            put_pfn(pfn + i);
+            page_zero(idx, pfn + i);
+        }
+        buddy_free(idx, a, pfn, order);
+        return 0;
+    }
+
+    for (i = 0; i < (1ULL << order); i++) {
+        if (get_pfn_refcount(pfn + i) == 0) continue;
+        put_pfn(pfn + i);
+        // still mapped somewhere: whoever drops the last reference frees it
+        if (get_pfn_refcount(pfn + i) == 0) frame_free(idx, USER_REG, pfn + i);
+    }
+    return 0;
+}
 
-    u64 pmd_e = ((u64)osmap( ( ( *((u64*)pud_e)  ) >> ADDR_SHIFT) ) ) + (pmdIdx)*(PTE_SIZE);
+/*
+ * Share of free buddy memory, per mille, that can't serve a run of the
+ * given order because it sits in smaller blocks (the unusable free space
+ * index).
+ */
+long vm_area_buddy_unusable(struct exec_context *current, u64 order)
+{
+    struct vm_index *idx = vm_index_of(current);
+    if (!idx || order >= BUDDY_ORDERS) return -EINVAL;
+    if (!idx->buddy || !idx->buddy->free_pages) return 0;
+    u64 total = idx->buddy->free_pages, usable = 0;
+    for (u64 k = order; k < BUDDY_ORDERS; k++)
+        usable += idx->buddy->free_blocks[k] << k;
+    return (long)((total - usable) * 1000 / total);
+}
 
-    if( ( *((u64*)pmd_e) & 1 ) == 0) {
-        return;
+/*
+ * Nothing under pmd_e is writable any more: drop W from it, and from
+ * pud_e too if that empties the PMD table of writable entries.  The PUD
+ * table is shared with the memory segments, so we stop there.
+ */
+void uPTPp(struct vm_index *idx, u64 *pud_e, u64 *pmd_e) {
+    if(pmd_e) {
+        if(pt_count_writable(idx, *pmd_e >> ADDR_SHIFT)) return;
+        pt_entry_set(idx, *pud_e >> ADDR_SHIFT, pmd_e, *pmd_e & ~(0x8));
     }
+    if(pt_count_writable(idx, *pud_e >> ADDR_SHIFT)) return;
+    *pud_e &= ~(0x8);
+}
 
-    u64 pte_entry_VA = ((u64)osmap( ( ( *((u64*)pmd_e)  ) >> ADDR_SHIFT) ) ) + (pteIdx)*(PTE_SIZE);
+void f_pfn(struct pt_walk *w, u64 *pte, u64 addr) {
+    u64 pfn = ( *pte >> ADDR_SHIFT );
 
-    if( ( *((u64*)pte_entry_VA) & 1 ) == 0) {
+    pt_entry_set(w->idx, *w->entry[2] >> ADDR_SHIFT, pte, 0x0);
+    w->idx->counters.small_pages--;
+    tlb_gather_page(w->tlb, addr);
+    if (pfn == w->idx->zero_pfn) {
+        w->idx->counters.zero_page_maps--;
         return;
     }
 
-    u64 pfn = ( *((u64*)pte_entry_VA) >> ADDR_SHIFT );
-
-    *((u64*)pte_entry_VA) = 0x0;
-
     if(get_pfn_refcount(pfn) == 0) return;
     put_pfn(pfn);
     
     if(get_pfn_refcount(pfn) == 0) {
-        os_pfn_free(USER_REG,pfn);
+        tlb_gather_free(w->tlb, USER_REG, pfn);
     }
-   
-    asm volatile("invlpg (%0);" ::"r"(addr) : "memory");
 }
 
-void freeAllPFNs(long addr_start, long addr_end) {
+void f_huge(struct pt_walk *w, u64 *pmd, u64 addr) {
+    u64 pfn = ( *pmd >> ADDR_SHIFT );
 
-    int numPages = (addr_end - addr_start) / (0x1000);
+    pt_entry_set(w->idx, *w->entry[1] >> ADDR_SHIFT, pmd, 0x0);
+    w->idx->counters.huge_pages--;
+    // one invlpg anywhere in the 2 MB page drops its TLB entry
+    tlb_gather_page(w->tlb, addr);
 
-    for(int i = 0; i < numPages; i++) {
-     f_pfn(addr_start + i*(0x1000));
+    for (u64 i = 0; i < HUGE_PAGES; i++) {
+        if(pfn + i == w->idx->zero_pfn || get_pfn_refcount(pfn + i) == 0) continue;
+        put_pfn(pfn + i);
+        if(get_pfn_refcount(pfn + i) == 0) {
+            tlb_gather_free(w->tlb, USER_REG, pfn + i);
+        }
     }
 }
-void updatePFN(long addr, int prot) {
-
-    struct exec_context *current = get_current_ctx();
-
-    u64 pgdIdx = (addr & PGD_MASK) >> PGD_SHIFT;
-    u64 pudIdx = (addr & PUD_MASK) >> PUD_SHIFT;
-    u64 pmdIdx = (addr & PMD_MASK) >> PMD_SHIFT;
-    u64 pteIdx = (addr & PTE_MASK) >> PTE_SHIFT;
-
-    u64 pgd_e = ((u64)osmap(current->pgd)) + (pgdIdx)*(PTE_SIZE);
 
-    if( ( *((u64*)pgd_e) & 1 ) == 0) {
-        return;
+int freeAllPFNs(struct exec_context *current, u64 addr_start, u64 addr_end) {
+    struct tlb_gather tlb;
+    struct pt_walk w = { .ctx = current, .idx = vm_index_of(current), .tlb = &tlb,
+                         .pte_fn = f_pfn, .huge_fn = f_huge, .drop_shared = 1, .reclaim = 1 };
+    tlb_gather_init(&tlb, w.idx);
+    int err = pt_walk_range(&w, addr_start, addr_end);
+    tlb_gather_flush(&tlb);
+    return err;
+}
+void updatePFN(struct pt_walk *w, u64 *pte, u64 addr) {
+    u64 *pgd_e = w->entry[0];
+    u64 *pud_e = w->entry[1];
+    u64 *pmd_e = w->entry[2];
+    u64 pte_entry_VA = (u64)pte;
+    u64 pt_pfn = *pmd_e >> ADDR_SHIFT;
+
+    if(w->prot == 1) {
+        if( !( *((u64*)pte_entry_VA) & 0x8 ) ) return;
+        pt_entry_set(w->idx, pt_pfn, (u64*)pte_entry_VA, *((u64*)pte_entry_VA) & ~(0x8));
+        uPTPp(w->idx, pud_e, pmd_e);
     }
+    else {
 
-    u64 pud_e = ((u64)osmap( ( ( *((u64*)pgd_e)  ) >> ADDR_SHIFT) ) ) + (pudIdx)*(PTE_SIZE);
+        // a frame still shared after cfork stays read-only, the first
+        // write copies it in handle_cow_fault
+        u64 pfn = ( ( *((u64*)pte_entry_VA)  ) >> ADDR_SHIFT );
+        if(pfn != w->idx->zero_pfn && get_pfn_refcount(pfn) == 1) {
+            pt_entry_set(w->idx, pt_pfn, (u64*)pte_entry_VA, *((u64*)pte_entry_VA) | 0x8);
+        }
+        pt_entry_set(w->idx, *pud_e >> ADDR_SHIFT, pmd_e, *pmd_e | 0x8);
+        *pud_e |= 0x8;
+        *pgd_e |= 0x8;
 
-    if( ( *((u64*)pud_e) & 1 ) == 0) {
-        return;
     }
+    
+    tlb_gather_page(w->tlb, addr);
+}
+void updateHuge(struct pt_walk *w, u64 *pmd, u64 addr) {
+    u64 pmd_pfn = *w->entry[1] >> ADDR_SHIFT;
 
-    u64 pmd_e = ((u64)osmap( ( ( *((u64*)pud_e)  ) >> ADDR_SHIFT) ) ) + (pmdIdx)*(PTE_SIZE);
-
-    if( ( *((u64*)pmd_e) & 1 ) == 0) {
-        return;
+    if(w->prot == 1) {
+        pt_entry_set(w->idx, pmd_pfn, pmd, *pmd & ~(0x8));
+        uPTPp(w->idx, w->entry[1], NULL);
     }
-
-    u64 pte_entry_VA = ((u64)osmap( ( ( *((u64*)pmd_e)  ) >> ADDR_SHIFT) ) ) + (pteIdx)*(PTE_SIZE);
-
-    if( ( *((u64*)pte_entry_VA) & 1 ) == 0) {
-        return;
+    else {
+        if(get_pfn_refcount(*pmd >> ADDR_SHIFT) == 1) {
+            pt_entry_set(w->idx, pmd_pfn, pmd, *pmd | 0x8);
+        }
+        *(w->entry[1]) |= 0x8;
+        *(w->entry[0]) |= 0x8;
     }
 
-    if(prot == 1) {
-        *((u64*)pte_entry_VA) &= ~(0x8);
+    tlb_gather_page(w->tlb, addr);
+}
 
-        u64 pfn = ( ( *((u64*)pte_entry_VA)  ) >> ADDR_SHIFT );
-        uPTPp(pfn,pgd_e,pud_e,pmd_e);
-    }
-    else {
+int updateAllPFNs(struct exec_context *current, u64 addr_start, u64 addr_end, int prot) {
+    struct tlb_gather tlb;
+    struct pt_walk w = { .ctx = current, .idx = vm_index_of(current), .tlb = &tlb,
+                         .pte_fn = updatePFN, .huge_fn = updateHuge, .prot = prot };
+    tlb_gather_init(&tlb, w.idx);
+    int err = pt_walk_range(&w, addr_start, addr_end);
+    tlb_gather_flush(&tlb);
+    return err;
+}
+/*
+ * MAP_POPULATE: back [start, end) with frames right away.  The walk
+ * allocates each missing table once and fills every PTE under it in the
+ * same pass; fully covered 2 MB slots get a huge page like the fault
+ * path would give them.  On failure the caller unmaps what was built.
+ */
+static int pt_alloc_table(struct vm_index *idx, int level, u64 pt_pfn, u64 *e, int writable)
+{
+    // level is that of e; only PMD and PTE tables are counted
+    u64 pfn = pt_table_alloc(idx, level >= 1);
+    if (!pfn) return -ENOMEM;
+    pt_entry_set(level >= 2 ? idx : NULL, pt_pfn, e, (pfn << ADDR_SHIFT) | 0x1 | 0x10 | (writable ? 0x8 : 0));
+    return 0;
+}
 
-        u64 pfn = ( ( *((u64*)pte_entry_VA)  ) >> ADDR_SHIFT );
-        if(get_pfn_refcount(pfn) > 1) {
-            u64 new_pfn = os_pfn_alloc(USER_REG);
-            *((u64*)pte_entry_VA) = (new_pfn << ADDR_SHIFT) | 0x11;
-            *((u64*)pte_entry_VA) |= 0x8;
-            
-            put_pfn(pfn);
-            if(get_pfn_refcount(pfn) == 0) {
-                os_pfn_free(USER_REG,pfn);
-            }
+static int populate_table(struct pt_walk *w, int level, u64 *e, u64 addr, u64 next)
+{
+    u64 pt_pfn = pt_walk_table(w, level);
+    int writable = (w->prot == (PROT_READ|PROT_WRITE));
+
+    if (*e & 1) {
+        // already backed by a 2 MB page; a shared table gets W when the walk unshares it
+        if (level == 2 && (*e & PTE_PS)) return 1;
+        if (writable && !(level == 2 && pt_table_shared(e)))
+            pt_entry_set(level >= 2 ? w->idx : NULL, pt_pfn, e, *e | 0x8);
+        return 0;
+    }
+    if (level == 2 && addr == (addr & ~(HUGE_SIZE - 1)) && next - addr == HUGE_SIZE) {
+        u64 pfn = huge_frame_alloc(w->idx);
+        if (pfn) {
+            pt_entry_set(w->idx, pt_pfn, e, (pfn << ADDR_SHIFT) | 0x1 | 0x10 | (writable ? 0x8 : 0) | PTE_PS);
+            w->idx->counters.huge_pages++;
+            return 1;
         }
-
-        *((u64*)pte_entry_VA) |= 0x8;
-        *((u64*)pmd_e) |= 0x8;
-        *((u64*)pud_e) |= 0x8;
-        *((u64*)pgd_e) |= 0x8;
-
+        w->idx->counters.huge_fallbacks++;
     }
-    
-    asm volatile("invlpg (%0);" ::"r"(addr) : "memory");
+    return pt_alloc_table(w->idx, level, pt_pfn, e, writable);
 }
-void updateAllPFNs(long addr_start, long addr_end, int prot) {
 
-    int numPages = (addr_end - addr_start) / (0x1000);
-
-    for(int i = 0; i < numPages; i++) {
-        updatePFN(addr_start + i*(0x1000), prot);
+static void populate_pte(struct pt_walk *w, u64 *pte, u64 addr)
+{
+    (void)addr;
+    if (*pte & 1) return;
+    u64 pfn = frame_alloc(w->idx, USER_REG);
+    if (!pfn) {
+        w->err = -ENOMEM;
+        return;
     }
+    u64 leaf = 0x1 | 0x10 | (w->prot == (PROT_READ|PROT_WRITE) ? 0x8 : 0);
+    pt_entry_set(w->idx, *w->entry[2] >> ADDR_SHIFT, pte, (pfn << ADDR_SHIFT) | leaf);
+    w->idx->counters.small_pages++;
 }
-long vm_area_mprotect(struct exec_context *current, u64 addr, int length, int prot) 
+
+static long vm_mprotect(struct exec_context *current, u64 addr, u64 length, int prot)
 {
-    if (length <= 0) return -EINVAL;
+    if (bad_range(addr, length)) return -EINVAL;
     if (prot != PROT_READ && prot != (PROT_READ|PROT_WRITE)) return -EINVAL ;
 
+    struct vm_index *idx = vm_index_of(current);
+    if (!idx) return -EINVAL;
+
     u64 len = pgsizecalc(length);
     u64 start = addr;
     u64 end = addr + len;
-    updateAllPFNs(addr,addr+len,prot);
-    struct vm_area *head = current->vm_area, *d = head, *d1 = head->vm_next;
-
-    while (d1&&d1->vm_start<=addr)
-    {
-        //if addr,addr+len lies completely
-        if((d1->vm_start<=addr)&&(d1->vm_end>=addr+len)&&(d1->access_flags!=prot)){
-            
-            if(d1->vm_start<addr&&d1->vm_end>addr+len)
-            {
-                struct vm_area* x=os_alloc(sizeof(struct vm_area));
-                x->vm_start=d1->vm_start;
-                x->vm_end=addr;
-                x->access_flags=d1->access_flags;
-                d->vm_next=x;
-                struct vm_area* x1=os_alloc(sizeof(struct vm_area));
-                x->vm_next=x1;
-                x1->vm_start=addr;
-                x1->vm_end=addr+len;
-                x1->access_flags=prot;
-                struct vm_area* x2=os_alloc(sizeof(struct vm_area));
-                x1->vm_next=x2;
-                x2->vm_start=addr+len;
-                x2->vm_end=d1->vm_end;
-                x2->access_flags=d1->access_flags;
-                x2->vm_next=d1->vm_next;
-                os_free(d1, sizeof(d1));
-                stats->num_vm_area+=2;  //imp
-                return 0;
-            }
-            if((d1->vm_start==addr)&&(d1->vm_end>addr+len)){
-                struct vm_area* x1=os_alloc(sizeof(struct vm_area));
-                
-                x1->vm_start=addr;
-                x1->vm_end=addr+len;
-                x1->access_flags=prot;
-                x1->vm_next=d1;
-                d->vm_next=x1;
-                d1->vm_start=addr+len;
-                stats->num_vm_area+=1;
-                //join 
-                goto exit;
-            }
-            if(d1->vm_start<addr&&d1->vm_end==addr+len){
-                struct vm_area* x=os_alloc(sizeof(struct vm_area));
-                x->vm_start=addr;
-                x->vm_end=d1->vm_end;
-                x->access_flags=prot;
-                x->vm_next=d1->vm_next;
-                d1->vm_next=x;
-                d1->vm_end=addr;
-                stats->num_vm_area+=1;
-                //join
-                goto exit;
-            }
-            if(d1->vm_start==addr&&d1->vm_end==addr+len){
-                d1->access_flags=prot;
-                goto exit;
-                
-            }
-
+    // a downgrade must reach the PTEs now; an upgrade only changes the VMAs
+    // and the first write to each page promotes it in handle_cow_fault
+    if (prot == PROT_READ) {
+        if (updateAllPFNs(current,addr,addr+len,prot)) return -ENOMEM;
+    } else {
+        idx->counters.mprotect_lazy++;
+    }
 
+    struct vm_area *prev = vma_walk_start(idx, start), *iter;
+    while ((iter = prev->vm_next) && iter->vm_start < end) {
+        if (iter->access_flags == prot) {
+            prev = iter;
+            continue;
         }
-        
-        //if d1 partially overlap from back
-        else if(d1->vm_start<=addr&&d1->vm_end<addr+len&&d1->access_flags!=prot){
-            if(d1->vm_start<addr){
-            struct vm_area* x=os_alloc(sizeof(struct vm_area));
-            x->vm_start=addr;
-            x->vm_end=d1->vm_end;
-            x->access_flags=prot;
-            x->vm_next=d1->vm_next;
-            d1->vm_end=addr;
-            d1->vm_next=x;
-            d=d->vm_next;
-            d1=d1->vm_next;
-            stats->num_vm_area+=1;
-            }
-            else{
-                d1->access_flags=prot;
-            }
-            
-        }//from front
-
-        else if(d1->vm_start>addr&&d1->vm_end<=addr+len&&d1->access_flags!=prot){
-            if(d1->vm_end<addr+len){
-            struct vm_area* x=os_alloc(sizeof(struct vm_area));
-            x->vm_start=addr+len;
-            x->vm_end=d1->vm_end;
-            d1->vm_end=addr+len;
-            x->access_flags=d1->access_flags;
-            d1->access_flags=prot;
-            x->vm_next=d1->vm_next;
-            d1->vm_next=x;
-            d=d->vm_next;
-            d1=d1->vm_next;
-            stats->num_vm_area+=1;
-            }
-            else{
-                d1->access_flags=prot;
-            }
-            return 0;
+        /* split off the part in front of the range, handle the rest next round */
+        if (iter->vm_start < start) {
+            if (!vma_split(idx, iter, start)) return -ENOMEM;
+            prev = iter;
+            continue;
         }
-        else if((d1->vm_start>addr && d1->vm_end<addr+len)){
-            d1->access_flags=prot;
-        }
-
-        d=d1;
-        d1=d1->vm_next;
+        if (iter->vm_end > end && !vma_split(idx, iter, end))
+            return -ENOMEM;
+        iter->access_flags = prot;
+        prev = iter;
     }
-    exit:
+
     //merge
-    struct vm_area* i1,*i2;
-    i1=current->vm_area;
-    i2=i1->vm_next;
-    while(i2){
-        if(i1->vm_end==i2->vm_start&&i1->access_flags==i2->access_flags){
-            //merge
-            i1->vm_end=i2->vm_end;
-            i1->vm_next=i2->vm_next;
-            i2=i2->vm_next;
-            os_free(i2,sizeof(i2));
-        }
-        else{
-        i1=i1->vm_next;
-        i2=i2->vm_next;
-        }
-    }
+    vma_merge_range(idx, start, end);
     return 0;
 }
 
+long vm_area_mprotect(struct exec_context *current, u64 addr, int length, int prot) 
+{
+    long ret = length <= 0 ? -EINVAL : vm_mprotect(current, addr, (u64)length, prot);
+    vm_trace(current, VM_TRACE_MPROTECT, addr, (u64)length, prot, 0, ret);
+    return ret;
+}
+
 
 
 
@@ -349,25 +2149,21 @@ long vm_area_mprotect(struct exec_context *current, u64 addr, int length, int pr
 // {
 //     return -EINVAL;
 // }
+static long vm_unmap(struct exec_context *current, u64 addr, u64 length);
+
 //add a dummy node
-long vm_area_map(struct exec_context *current, u64 addr, int length, int prot, int flags)
+static long vm_map(struct exec_context *current, u64 addr, u64 length, int prot, int flags)
 {
-    struct vm_area *head = current->vm_area;
+    struct vm_index *idx = vm_index_of(current);
     /* ——— initialize the dummy head if this is the first mmap ——— */
-    if (!head) {
-        struct vm_area *x = os_alloc(sizeof(*x));
-        if (!x) return -ENOMEM;
-        x->vm_start     = MMAP_AREA_START;
-        x->vm_end       = MMAP_AREA_START + 0x1000;
-        x->access_flags = 0;
-        x->vm_next      = NULL;
-        current->vm_area = x;
-        stats->num_vm_area = 1;
-        head = x;
+    if (!idx) {
+        idx = vm_index_init(current, NULL);
+        if (!idx) return -ENOMEM;
     }
+    struct vm_area *head = &idx->head;
 
     /* ——— validate arguments ——— */
-    if (length <= 0 || length > (2 << 20))
+    if (bad_range(addr, length))
         return -EINVAL;
     if (prot != PROT_READ && prot != (PROT_READ|PROT_WRITE))
         return -EINVAL;
@@ -384,10 +2180,8 @@ long vm_area_map(struct exec_context *current, u64 addr, int length, int prot, i
         u64 end = addr + length_aligned;
         if (addr < MMAP_AREA_START || end > MMAP_AREA_END)
             return -EINVAL;
-        for (struct vm_area *q = head->vm_next; q; q = q->vm_next) {
-            if (range_overlap(addr, end, q->vm_start, q->vm_end))
-                return -EINVAL;
-        }
+        if (vma_overlaps(idx, addr, end))
+            return -EINVAL;
         start = addr;
         found = 1;
     }
@@ -396,41 +2190,23 @@ long vm_area_map(struct exec_context *current, u64 addr, int length, int prot, i
     if (!found && addr) {
         u64 hint_start = addr;
         u64 hint_end   = addr + length_aligned;
-        if (hint_start >= MMAP_AREA_START && hint_end <= MMAP_AREA_END) {
-            int ok = 1;
-            for (struct vm_area *q = head->vm_next; q; q = q->vm_next) {
-                if (range_overlap(hint_start, hint_end, q->vm_start, q->vm_end)) {
-                    ok = 0;
-                    break;
-                }
-            }
-            if (ok) {
-                start = hint_start;
-                found = 1;
-            }
+        if (hint_start >= MMAP_AREA_START && hint_end <= MMAP_AREA_END &&
+            !vma_overlaps(idx, hint_start, hint_end)) {
+            start = hint_start;
+            found = 1;
         }
     }
 
     /* ——— find the first hole big enough in between existing VMAs ——— */
     if (!found) {
-        struct vm_area *prev = head;
-        for (struct vm_area *q = head->vm_next; q; prev = q, q = q->vm_next) {
-            u64 hole_start = (prev->vm_end < MMAP_AREA_START
-                              ? MMAP_AREA_START
-                              : prev->vm_end);
-            u64 hole_end   = (q->vm_start > MMAP_AREA_END
-                              ? MMAP_AREA_END
-                              : q->vm_start);
-            if (hole_end - hole_start >= length_aligned) {
-                start = hole_start;
-                found = 1;
-                break;
-            }
+        struct vm_area *q = vm_tree_first_fit(idx->root, length_aligned);
+        if (q) {
+            start = q->vm_start - VM_NODE(q)->gap;
+            found = 1;
         }
         /* ——— after the last VMA ——— */
         if (!found) {
-            struct vm_area *last = head;
-            while (last->vm_next) last = last->vm_next;
+            struct vm_area *last = vma_last(idx);
             u64 hole_start = (last->vm_end < MMAP_AREA_START
                               ? MMAP_AREA_START
                               : last->vm_end);
@@ -445,44 +2221,50 @@ long vm_area_map(struct exec_context *current, u64 addr, int length, int prot, i
         return -ENOMEM;
 
     /* ——— now do the one‐off “create new VMA and merge” step ——— */
-    struct vm_area *d = head;
-    while (d->vm_next && d->vm_next->vm_start < start)
-        d = d->vm_next;
+    struct vm_area *d = vma_prev(idx, start);
 
-    struct vm_area *vm = os_alloc(sizeof(*vm));
+    struct vm_area *vm = vma_alloc(idx, start, start + length_aligned, prot);
     if (!vm)
         return -ENOMEM;
-
-    vm->vm_start     = start;
-    vm->vm_end       = start + length_aligned;
-    vm->access_flags = prot;
-    vm->vm_next      = d->vm_next;
-    d->vm_next       = vm;
-    stats->num_vm_area++;
+    vma_link(idx, d, vm);
 
     /* merge with next */
     if (vm->vm_next &&
         vm->vm_end == vm->vm_next->vm_start &&
         vm->access_flags == vm->vm_next->access_flags) {
         struct vm_area *n = vm->vm_next;
-        vm->vm_end   = n->vm_end;
-        vm->vm_next  = n->vm_next;
-        os_free(n, sizeof(*n));
-        stats->num_vm_area--;
+        vm->vm_end = n->vm_end;
+        vma_unlink(idx, vm, n);
+        vma_free(idx, n);
     }
     /* merge with previous */
     if (d != head &&
         d->vm_end == vm->vm_start &&
         d->access_flags == vm->access_flags) {
-        d->vm_end   = vm->vm_end;
-        d->vm_next  = vm->vm_next;
-        os_free(vm, sizeof(*vm));
-        stats->num_vm_area--;
-        start = d->vm_start;
+        d->vm_end = vm->vm_end;
+        vma_unlink(idx, d, vm);
+        vma_free(idx, vm);
+    }
+
+    /* ——— MAP_POPULATE: fault the whole range in now ——— */
+    if (flags & MAP_POPULATE) {
+        struct pt_walk w = { .ctx = current, .idx = idx, .prot = prot, .all_ptes = 1,
+                             .table_fn = populate_table, .pte_fn = populate_pte };
+        if (pt_walk_range(&w, start, start + length_aligned)) {
+            vm_unmap(current, start, length_aligned);
+            return -ENOMEM;
+        }
     }
 
     return (long) start;
 }
+
+long vm_area_map(struct exec_context *current, u64 addr, int length, int prot, int flags)
+{
+    long ret = length <= 0 ? -EINVAL : vm_map(current, addr, (u64)length, prot, flags);
+    vm_trace(current, VM_TRACE_MAP, addr, (u64)length, prot, flags, ret);
+    return ret;
+}
 /**
  * munmap system call implemenations
  */
@@ -492,128 +2274,93 @@ long vm_area_map(struct exec_context *current, u64 addr, int length, int prot, i
 //     return -EINVAL;
 // }
 
-long vm_area_unmap(struct exec_context *current, u64 addr, int length) 
+/*
+ * The mmap window is empty again.  Nothing is left that needs the
+ * per-context memory kept for the mappings, so give it back here
+ * rather than holding it until vm_area_exit.
+ */
+static void vm_window_empty(struct vm_index *idx)
+{
+    vm_slab_release(idx);
+    pt_count_release(idx);
+    zero_pool_release(idx, USER_REG);
+    zero_pool_release(idx, OS_PT_REG);
+    zero_page_put(idx);
+    buddy_put(idx);
+}
+
+/* everything the index still holds once its window is empty, and the index itself */
+static void vm_index_free(struct vm_index *idx)
 {
-    if (length <= 0) return -EINVAL;
+    vm_window_empty(idx);
+    vm_trace_put(idx);
+    if (idx->fault_stats)
+        os_pfn_free(OS_DS_REG, idx->fault_stats);
+    os_free(idx, sizeof(*idx));
+}
+
+static long vm_unmap(struct exec_context *current, u64 addr, u64 length)
+{
+    if (bad_range(addr, length)) return -EINVAL;
+    struct vm_index *idx = vm_index_of(current);
+    if (!idx) return -EINVAL;
+
     u64 len = pgsizecalc(length);
     u64 start = addr;
     u64 end = addr + len;
-    struct vm_area *head = current->vm_area, *d = head, *d1 = head->vm_next;
-    freeAllPFNs(addr,addr+len);
-    while (d1) 
-    {
-        //if (addr,addr+len) lies completely
-
-        if((d1->vm_start<=addr)&&(d1->vm_end>=addr+len)){
-            
-            if(d1->vm_start<addr&&d1->vm_end>addr+len){
-                struct vm_area* x=os_alloc(sizeof(struct vm_area));
-                x->vm_start=d1->vm_start;
-                x->vm_end=addr;
-                x->access_flags=d1->access_flags;
-                d->vm_next=x;
-                struct vm_area* x1=os_alloc(sizeof(struct vm_area));
-                x->vm_next=x1;
-                x1->vm_start=addr+len;
-                x1->vm_end=d1->vm_end;
-                x1->access_flags=d1->access_flags;
-                x1->vm_next=d1->vm_next;
-                os_free(d1, sizeof(d1));
-                stats->num_vm_area++;
-                return 0;
-            }
-            if((d1->vm_start==addr)&&(d1->vm_end>addr+len)){
-                struct vm_area* x1=os_alloc(sizeof(struct vm_area));
-                
-                x1->vm_start=addr+len;
-                x1->vm_end=d1->vm_end;
-                x1->access_flags=d1->access_flags;
-                x1->vm_next=d1->vm_next;
-                d->vm_next=x1;
-                os_free(d1, sizeof(d1));
-                return 0;
-            }
-            if(d1->vm_start<addr&&d1->vm_end==addr+len){
-                struct vm_area* x=os_alloc(sizeof(struct vm_area));
-                x->vm_start=d1->vm_start;
-                x->vm_end=addr;
-                x->access_flags=d1->access_flags;
-                x->vm_next=d1->vm_next;
-                d->vm_next=x;
-                os_free(d1, sizeof(d1));
-                
-                return 0;
-            }
-            if(d1->vm_start==addr&&d1->vm_end==addr+len){
-                d->vm_next=d1->vm_next;
-                os_free(d1, sizeof(d1));
-                stats->num_vm_area--;
-                return 0;
-            }
-
-
-        }
-        //if d1 partially overlap from back
-        else if(d1->vm_start<=addr&&d1->vm_end<addr+len){
-            if(d1->vm_start<addr){
-            struct vm_area* x=os_alloc(sizeof(struct vm_area));
-            x->vm_start=d1->vm_start;
-            x->vm_end=addr;
-            x->access_flags=d1->access_flags;
-            x->vm_next=d1->vm_next;
-            d->vm_next=x;
-            d=d->vm_next;
-            struct vm_area* t=d1->vm_next;
-            os_free(d1, sizeof(d1));
-            d1=t;
-            }
-            else{
-                d->vm_next=d1->vm_next;
-                struct vm_area* t=d1->vm_next;
-                os_free(d1, sizeof(d1));
-                stats->num_vm_area--;
-                
-                d1=t;
-            }
-            if(d1==0)return 0;
-        }//from front
-        else if(d1->vm_start>addr&&d1->vm_end<=addr+len){
-            if(d1->vm_end<addr+len){
-            struct vm_area* x=os_alloc(sizeof(struct vm_area));
-            x->vm_start=addr+len;
-            x->vm_end=d1->vm_end;
-            x->access_flags=d1->access_flags;
-            x->vm_next=d1->vm_next;
-            d->vm_next=x;
-            d=d->vm_next;
-            struct vm_area* t=d1->vm_next;
-            os_free(d1, sizeof(d1));
-            d=d->vm_next;
-            d1=t;
-            }
-            else{
-                d->vm_next=d1->vm_next;
-                struct vm_area* t=d1->vm_next;
-                os_free(d1, sizeof(d1));
-                stats->num_vm_area--;
-                
-                d1=t;
-            }
-            return 0;
+    if (freeAllPFNs(current,addr,addr+len)) return -ENOMEM;
+    vmacache_flush(idx);
+
+    struct vm_area *prev = vma_walk_start(idx, start), *iter;
+    while ((iter = prev->vm_next) && iter->vm_start < end) {
+        //starts before the range: keep the front, and the back too if it spans it
+        if (iter->vm_start < start) {
+            if (iter->vm_end > end && !vma_split(idx, iter, end))
+                return -ENOMEM;
+            iter->vm_end = start;
+            vma_gap_fix(idx, iter, iter->vm_next);
+            prev = iter;
+            continue;
         }
-        else if((d1->vm_start>addr && d1->vm_end<addr+len)){
-                d->vm_next=d1->vm_next;
-                struct vm_area* t=d1->vm_next;
-                os_free(d1, sizeof(d1));
-                stats->num_vm_area--;
-                d1=t;
-                if(d1==0)return 0;
+        //sticks out past the range: trim the front
+        if (iter->vm_end > end) {
+            iter->vm_start = end;
+            vma_gap_fix(idx, prev, iter);
+            break;
         }
+        //lies completely inside
+        vma_unlink(idx, prev, iter);
+        vma_free(idx, iter);
+    }
+    if (!idx->root)
+        vm_window_empty(idx);
+    return 0;
+}
 
-        
+long vm_area_unmap(struct exec_context *current, u64 addr, int length) 
+{
+    long ret = length <= 0 ? -EINVAL : vm_unmap(current, addr, (u64)length);
+    vm_trace(current, VM_TRACE_UNMAP, addr, (u64)length, 0, 0, ret);
+    return ret;
+}
 
-    }
-    return 0;;
+/*
+ * The context is going away: unmap the whole window, which frees its
+ * frames and page tables, then the slabs, pools, count radix, zero
+ * page, buddy arenas and stats page, and the vm_index.  vm_area_exit
+ * leaves current->vm_area NULL, so the exit path must call it before
+ * anything walks that list: the nodes live in per-context slabs and
+ * must never be os_freed one by one.
+ */
+void vm_area_exit(struct exec_context *current)
+{
+    struct vm_index *idx = vm_index_of(current);
+    if (!idx) return;
+    if (idx->root)
+        vm_unmap(current, MMAP_AREA_START, MMAP_AREA_SIZE);
+    vm_index_free(idx);
+    current->vm_area = NULL;
+    stats->num_vm_area = 0;
 }
 
 
@@ -622,29 +2369,75 @@ long vm_area_unmap(struct exec_context *current, u64 addr, int length)
 //     return -1;
 //}
 
-long vm_area_pagefault(struct exec_context *current, u64 addr, int error_code)
-{   //printk("%d",error_code);
-    if (addr < 0)
-    {
-        return -EINVAL;
+/*
+ * Look at the pages prefetched by the previous fault-around: if fewer
+ * than half were touched since (accessed bit still clear) halve the
+ * window, if all of them were let it grow back towards fa_max.
+ */
+static void fault_around_adapt(struct vm_index *idx)
+{
+    u64 prefetched = 0, touched = 0;
+    u64 *pte = &((u64 *)osmap(idx->fa_pt))[(idx->fa_addr >> PTE_SHIFT) & (PTRS_PER_PT - 1)];
+    for (u64 i = 0; i < FAULT_AROUND_MAX && idx->fa_mask >> i; i++) {
+        if (!(idx->fa_mask & (1ULL << i))) continue;
+        prefetched++;
+        if (pte[i] & PTE_A)
+            touched++;
     }
-    
+    idx->fa_mask = 0;
+
+    if (touched * 2 < prefetched) {
+        if (idx->fa_window > 1) idx->fa_window >>= 1;
+    } else if (prefetched && touched == prefetched) {
+        if (idx->fa_window < idx->fa_max) idx->fa_window <<= 1;
+    }
+}
+
+/* read faults fill the window with the zero page, write faults with real frames */
+static void fault_around(struct vm_index *idx, struct vm_area *vma, u64 pt_pfn, u64 addr, int read)
+{
+    u64 *pt = (u64 *)osmap(pt_pfn);
+    fault_around_adapt(idx);
+    if (idx->fa_window <= 1) {
+        /* collapsed: every so often try a small window again */
+        if (idx->fa_max <= 1 || ++idx->fa_idle < FAULT_AROUND_PROBE) return;
+        idx->fa_idle   = 0;
+        idx->fa_window = 2;
+    }
+
+    u64 span = idx->fa_window << PTE_SHIFT;
+    u64 lo = addr & ~(span - 1), hi = lo + span;
+    u64 leaf = 0x1 | 0x10 | (vma->access_flags == 0x3 && !read ? 0x8 : 0);
+    idx->fa_addr = lo;
+    idx->fa_pt   = pt_pfn;
+    if (lo < vma->vm_start) lo = vma->vm_start;
+    if (hi > vma->vm_end) hi = vma->vm_end;
+
+    for (u64 va = lo; va < hi; va += 0x1000) {
+        u64 *e = &pt[(va >> PTE_SHIFT) & (PTRS_PER_PT - 1)];
+        if (*e & 1) continue;
+        u64 pfn = read ? zero_page_get(idx) : frame_alloc(idx, USER_REG);
+        if (!pfn) break;
+        pt_entry_set(idx, pt_pfn, e, (pfn << ADDR_SHIFT) | leaf);
+        idx->fa_mask |= 1ULL << ((va - idx->fa_addr) >> PTE_SHIFT);
+        idx->counters.small_pages++;
+        idx->counters.fault_around_pages++;
+    }
+}
+
+static long cow_fault(struct exec_context *current, u64 vaddr, int access_flags, struct fault_info *fi);
+
+static long page_fault(struct exec_context *current, u64 addr, int error_code, struct fault_info *fi)
+{
     // find the vm_area corresponding to the faulting address
-    struct vm_area *vma = current->vm_area;
-    int flag = 0;
-    while (vma != NULL)
+    struct vm_index *idx = vm_index_of(current);
+    if (!idx)
     {
-        if (vma->vm_start <= addr && vma->vm_end > addr)
-        {
-            flag = 1;
-            break;
-        }
-        else if (addr < vma->vm_start)
-            break;
-        vma = vma->vm_next;
+        return -EINVAL;
     }
+    struct vm_area *vma = vma_find_cached(idx, addr);
 
-    if (flag == 0)
+    if (vma == NULL)
     {
         return -EINVAL;
     }
@@ -658,7 +2451,10 @@ long vm_area_pagefault(struct exec_context *current, u64 addr, int error_code)
     // Another invalid fault can occur if there is a write access to a page with read only permission
     if (error_code == 0x7)
     {
-        return -1;
+        if (vma->access_flags == PROT_READ)
+            return -1;
+        // writable vma but read-only pte: the page is shared copy-on-write
+        return cow_fault(current, addr, vma->access_flags, fi);
     }
 
     // Manipulate Page Table
@@ -675,10 +2471,12 @@ long vm_area_pagefault(struct exec_context *current, u64 addr, int error_code)
     // check if page frame has been allocated for the next level of the page table
     if( ( *((u64*)pgd_e) & 1 ) == 0) {
         // allocate pfn for pud_t
-        u64 pud_pfn = os_pfn_alloc(OS_PT_REG);
+        u64 pud_pfn = pt_table_alloc(idx, 0);
         if(pud_pfn == 0) {
+            fi->cls = FAULT_NOMEM;
             return -EINVAL;
         }
+        fi->pt_levels++;
 
         // update the pgd_entry
         *((u64*)pgd_e) = (pud_pfn << ADDR_SHIFT) | 0x1;  // set the present bit along with the pfn value
@@ -695,10 +2493,12 @@ long vm_area_pagefault(struct exec_context *current, u64 addr, int error_code)
     // check if page frame has been allocated for the next level of the page table
     if( ( *((u64*)pud_e) & 1 ) == 0) {
         // allocate pfn for pmd_t
-        u64 pmd_pfn = os_pfn_alloc(OS_PT_REG);
+        u64 pmd_pfn = pt_table_alloc(idx, 1);
         if(pmd_pfn == 0) {
+            fi->cls = FAULT_NOMEM;
             return -EINVAL;
         }
+        fi->pt_levels++;
 
         // update the pud_entry
         *((u64*)pud_e) = (pmd_pfn << ADDR_SHIFT) | 0x1;  // set the present bit along with the pfn value
@@ -710,52 +2510,144 @@ long vm_area_pagefault(struct exec_context *current, u64 addr, int error_code)
     }
 
     // calculate the entry of in the third level of the page table
-    u64 pmd_e = ((u64)osmap( ( ( *((u64*)pud_e)  ) >> ADDR_SHIFT) ) ) + (pmdIdx)*(PTE_SIZE);
+    u64 pmd_table = *((u64*)pud_e) >> ADDR_SHIFT;
+    u64 pmd_e = ((u64)osmap( pmd_table ) ) + (pmdIdx)*(PTE_SIZE);
+
+    // already backed by a 2 MB page, nothing to allocate
+    if( ( *((u64*)pmd_e) & (0x1 | PTE_PS) ) == (0x1 | PTE_PS) ) {
+        return 1;
+    }
+
+    // the vma covers this whole 2 MB slot: try to map it with one huge page,
+    // unless this is a read, which the zero page serves without any memory
+    u64 huge_start = addr & ~(HUGE_SIZE - 1);
+    if( error_code != ERR_CODE_READ && ( *((u64*)pmd_e) & 1 ) == 0 && vma->vm_start <= huge_start && huge_start + HUGE_SIZE <= vma->vm_end) {
+        u64 huge_pfn = huge_frame_alloc(idx);
+        if(huge_pfn) {
+            u64 huge_e = (huge_pfn << ADDR_SHIFT) | 0x1 | 0x10 | PTE_PS;
+            if(vma->access_flags == 0x3) {
+                huge_e |= 0x8;
+            }
+            pt_entry_set(idx, pmd_table, (u64*)pmd_e, huge_e);
+            idx->counters.huge_pages++;
+            tlb_flush_page(idx, addr);
+            fi->cls = FAULT_HUGE;
+            return 1;
+        }
+        idx->counters.huge_fallbacks++;
+    }
 
     // check if page frame has been allocated for the next level of the page table
     if( ( *((u64*)pmd_e) & 1 ) == 0) {
         // allocate pfn for pte_t
-        u64 pte_pfn = os_pfn_alloc(OS_PT_REG);
+        u64 pte_pfn = pt_table_alloc(idx, 1);
         if(pte_pfn == 0) {
+            fi->cls = FAULT_NOMEM;
             return -EINVAL;
         }
+        fi->pt_levels++;
 
         // update the pmd_entry
-        *((u64*)pmd_e) = (pte_pfn << ADDR_SHIFT) | 0x1;  // set the present bit along with the pfn value
-        *((u64*)pmd_e) |= 0x10;                          // set the user bit
+        u64 table_e = (pte_pfn << ADDR_SHIFT) | 0x1;    // set the present bit along with the pfn value
+        table_e |= 0x10;                                // set the user bit
 
         if(vma->access_flags == 0x3) {
-            *((u64*)pmd_e) |= 0x8;                       // set the read/write bit
+            table_e |= 0x8;                             // set the read/write bit
+        }
+        pt_entry_set(idx, pmd_table, (u64*)pmd_e, table_e);
+    }
+
+    // PTE table still shared with a cfork relative: take a private copy first
+    if( pt_table_shared((u64*)pmd_e) ) {
+        if( pt_unshare(idx, pmd_table, (u64*)pmd_e) ) {
+            fi->cls = FAULT_NOMEM;
+            return -EINVAL;
         }
+        fi->pt_levels++;
     }
 
     // calculate the entry of in the final level of the page table
-    u64 pte_entry_VA = ((u64)osmap( ( ( *((u64*)pmd_e)  ) >> ADDR_SHIFT) ) ) + (pteIdx)*(PTE_SIZE);
+    u64 pte_table = *((u64*)pmd_e) >> ADDR_SHIFT;
+    u64 pte_entry_VA = ((u64)osmap( pte_table ) ) + (pteIdx)*(PTE_SIZE);
 
     // check if page frame has been allocated for the final level of the page table
     if( ( *((u64*)pte_entry_VA) & 1 ) == 0) {
-        // allocate pfn for pte_t
-        u64 user_called_pfn = os_pfn_alloc(USER_REG);
+        // a read gets the shared zero page, a write its own frame
+        int read = error_code == ERR_CODE_READ;
+        u64 user_called_pfn = read ? zero_page_get(idx) : frame_alloc(idx, USER_REG);
         if(user_called_pfn == 0) {
+            fi->cls = FAULT_NOMEM;
             return -EINVAL;
         }
 
         // update the pte_entry
-        *((u64*)pte_entry_VA) = (user_called_pfn << ADDR_SHIFT) | 0x1;  // set the present bit along with the pfn value
-        *((u64*)pte_entry_VA) |= 0x10;                                  // set the user bit
-        if(vma->access_flags == 0x3) {
-            *((u64*)pte_entry_VA) |= 0x8;                               // set the read/write bit
-        }
-        else {
-            *((u64*)pte_entry_VA) &= ~(0x8);  
+        u64 leaf_e = (user_called_pfn << ADDR_SHIFT) | 0x1;   // set the present bit along with the pfn value
+        leaf_e |= 0x10;                                       // set the user bit
+        if(vma->access_flags == 0x3 && !read) {
+            leaf_e |= 0x8;                                    // set the read/write bit
+
+            // mprotect may have dropped W from the tables above
+            if( !( *((u64*)pmd_e) & 0x8 ) ) {
+                pt_entry_set(idx, pmd_table, (u64*)pmd_e, *((u64*)pmd_e) | 0x8);
+            }
+            *((u64*)pud_e) |= 0x8;
+            *((u64*)pgd_e) |= 0x8;
         }
+        pt_entry_set(idx, pte_table, (u64*)pte_entry_VA, leaf_e);
+        idx->counters.small_pages++;
+
+        tlb_flush_page(idx, addr);
 
-        asm volatile("invlpg (%0);" ::"r"(addr) : "memory");
+        fault_around(idx, vma, pte_table, addr, read);
+        fi->cls = read ? FAULT_ZERO : FAULT_PAGE;
     }
 
     return 1;
 }
 
+/* the fault stats page, allocated on first use; NULL if there is no memory for it */
+static struct vm_fault_stats *fault_stats_of(struct vm_index *idx)
+{
+    if (!idx->fault_stats) {
+        u64 pfn = os_pfn_alloc(OS_DS_REG);
+        if (!pfn) return NULL;
+        u64 *p = (u64 *)osmap(pfn);
+        for (u64 i = 0; i < 0x1000 / sizeof(u64); i++)
+            p[i] = 0;
+        idx->fault_stats = pfn;
+    }
+    return (struct vm_fault_stats *)osmap(idx->fault_stats);
+}
+
+/*
+ * Time the fault with the TSC and file it under its class.  Failures
+ * page_fault didn't mark as out of memory are invalid accesses.  Faults
+ * before the first mmap have no vm_index to count in.
+ */
+long vm_area_pagefault(struct exec_context *current, u64 addr, int error_code)
+{
+    struct fault_info fi = { FAULT_SPURIOUS, 0 };
+    u64 start = rdtsc();
+    long ret = page_fault(current, addr, error_code, &fi);
+    u64 cycles = rdtsc() - start;
+
+    vm_trace(current, VM_TRACE_FAULT, addr, 0, error_code, 0, ret);
+    struct vm_index *idx = vm_index_of(current);
+    struct vm_fault_stats *fs = idx ? fault_stats_of(idx) : NULL;
+    if (!fs) return ret;
+    if (ret < 0 && fi.cls != FAULT_NOMEM)
+        fi.cls = FAULT_INVALID;
+
+    int bucket = 0;
+    while (bucket < FAULT_HIST_BUCKETS - 1 && cycles >> (bucket + 1))
+        bucket++;
+    fs->faults[fi.cls]++;
+    fs->cycles[fi.cls] += cycles;
+    fs->hist[fi.cls][bucket]++;
+    fs->pt_levels[fi.pt_levels < FAULT_PT_LEVELS ? fi.pt_levels : FAULT_PT_LEVELS - 1]++;
+    return ret;
+}
+
 
 /**
  * Function will invoked whenever there is page fault for an address in the vm area region
@@ -764,6 +2656,185 @@ long vm_area_pagefault(struct exec_context *current, u64 addr, int error_code)
 
 
 
+/*
+ * CoW fork of the user page tables, as a walk of the parent's.  Only its
+ * populated subtrees are visited: the matching child tables are built on
+ * the way down (w->dst holds them) and every leaf (4 KB PTE or 2 MB PMD)
+ * is shared read-only, with one more reference taken on each frame it
+ * maps.  With share_tables the walk stops one level higher and whole PTE
+ * tables are shared, so the cost is per 2 MB slot rather than per page.
+ * The caller flushes the TLB once at the end.
+ */
+static u64 *cow_dst_entry(struct pt_walk *w, int level, u64 addr)
+{
+    return &((u64 *)osmap(w->dst[level]))[(addr >> PT_LEVEL_SHIFT(level)) & (PTRS_PER_PT - 1)];
+}
+
+static void cow_share_leaf(struct pt_walk *w, int level, u64 *e, u64 addr)
+{
+    u64 *dst = cow_dst_entry(w, level, addr);
+    if (*dst & 1) return;
+    u64 pfn = *e >> ADDR_SHIFT;
+    u64 pages = level == 3 ? 1 : HUGE_PAGES;
+    for (u64 k = 0; k < pages; k++)
+        if (!w->idx || pfn + k != w->idx->zero_pfn) get_pfn(pfn + k);
+    pt_entry_set(w->idx, pt_walk_table(w, level), e, *e & ~(0x8));
+    pt_entry_set(w->dst_idx, w->dst[level], dst, *e);
+    if (w->dst_idx) {
+        if (level == 3) w->dst_idx->counters.small_pages++;
+        else w->dst_idx->counters.huge_pages++;
+    }
+}
+
+static void cow_copy_pte(struct pt_walk *w, u64 *pte, u64 addr)
+{
+    cow_share_leaf(w, 3, pte, addr);
+}
+
+static int cow_copy_table(struct pt_walk *w, int level, u64 *e, u64 addr, u64 next)
+{
+    (void)next;
+    if (!(*e & 1)) return 1;
+    if (level == 2 && (*e & PTE_PS)) {
+        cow_share_leaf(w, 2, e, addr);
+        return 1;
+    }
+    u64 src_pfn = pt_walk_table(w, level);
+    u64 *dst = cow_dst_entry(w, level, addr);
+    // entries of PMD and PTE tables in the mmap window are counted
+    struct vm_index *pidx = level >= 2 ? w->idx : NULL;
+    struct vm_index *cidx = level >= 2 ? w->dst_idx : NULL;
+
+    if (level == 2 && w->share_tables) {
+        if (*dst & 1) return 1;
+        u64 pt_pfn = *e >> ADDR_SHIFT;
+        struct pt_count *pc = pt_count_of(pidx, pt_pfn, 0);
+        struct pt_count *cc = pt_count_of(cidx, pt_pfn, 1);
+        if (!cc) return -ENOMEM;
+        *cc = pc ? *pc : (struct pt_count){ pt_table_present((u64 *)osmap(pt_pfn)), PTRS_PER_PT };
+        // a table nobody counted yet: its owner holds the first reference
+        if (get_pfn_refcount(pt_pfn) == 0) get_pfn(pt_pfn);
+        get_pfn(pt_pfn);
+        pt_entry_set(pidx, src_pfn, e, *e & ~(0x8));
+        pt_entry_set(cidx, w->dst[2], dst, *e);
+        w->dst_idx->counters.small_pages += cc->present;
+        w->dst_idx->counters.pt_pages_live++;
+        return 1;
+    }
+    if (!(*dst & 1)) {
+        // the child's PMD tables in the window get counted too
+        u64 pfn = pt_table_alloc(w->dst_idx, level >= 1);
+        if (!pfn) return -ENOMEM;
+        pt_entry_set(cidx, w->dst[level], dst, (pfn << ADDR_SHIFT) | (*e & 0xFFF));
+    }
+    w->dst[level + 1] = *dst >> ADDR_SHIFT;
+    return 0;
+}
+
+static int cow_copy_range(struct exec_context *ctx, struct exec_context *new_ctx,
+                          struct vm_index *idx, u64 start, u64 end)
+{
+    struct pt_walk w = { .ctx = ctx, .idx = idx ? vm_index_of(ctx) : NULL, .dst_idx = idx,
+                         .table_fn = cow_copy_table, .pte_fn = cow_copy_pte,
+                         .share_tables = idx != NULL, .dst = { new_ctx->pgd } };
+    return pt_walk_range(&w, start, end);
+}
+
+/* give the child its own vm_index holding a copy of every parent VMA */
+static int cow_copy_vmas(struct exec_context *ctx, struct exec_context *new_ctx)
+{
+    struct vm_index *pidx = vm_index_of(ctx);
+    new_ctx->vm_area = NULL;
+    if (!pidx) return 0;
+
+    struct vm_index *cidx = vm_index_init(new_ctx, pidx);
+    if (!cidx) return -ENOMEM;
+    cidx->fa_max    = pidx->fa_max;
+    cidx->fa_window = pidx->fa_max;
+    // every PTE on the zero page is copied below, so is the count; the
+    // child's index gets a reference of its own
+    if (pidx->zero_pfn) {
+        get_pfn(pidx->zero_pfn);
+        cidx->zero_pfn = pidx->zero_pfn;
+        cidx->counters.zero_page_maps = pidx->counters.zero_page_maps;
+    }
+    // frames from the parent's arenas are shared below: whichever side
+    // frees one last must find the arena it came from
+    if (pidx->buddy) {
+        pidx->buddy->sharers++;
+        cidx->buddy = pidx->buddy;
+    }
+    if (pidx->trace) {
+        pidx->trace->sharers++;
+        cidx->trace = pidx->trace;
+    }
+
+    struct vm_area *last = &cidx->head;
+    for (struct vm_area *v = pidx->head.vm_next; v; v = v->vm_next) {
+        struct vm_area *copy = vma_alloc(cidx, v->vm_start, v->vm_end, v->access_flags);
+        if (!copy) return -ENOMEM;
+        vma_link(cidx, last, copy);
+        last = copy;
+    }
+    return 0;
+}
+
+/* the segments' part of a cfork copy: put the leaf references, free the child's tables */
+static void cow_undo_table(u64 pt_pfn, int level)
+{
+    u64 *t = (u64 *)osmap(pt_pfn);
+    for (u64 i = 0; i < PTRS_PER_PT; i++) {
+        if (!(t[i] & 1)) continue;
+        u64 pfn = t[i] >> ADDR_SHIFT;
+        if (level < 3 && !(level == 2 && (t[i] & PTE_PS))) {
+            cow_undo_table(pfn, level + 1);
+            os_pfn_free(OS_PT_REG, pfn);
+            continue;
+        }
+        // the parent still maps it with the reference it had before
+        for (u64 k = 0; k < (level == 3 ? 1 : HUGE_PAGES); k++)
+            put_pfn(pfn + k);
+    }
+}
+
+/*
+ * cfork failed part way: give back every reference the copy took and
+ * free the child's tables, its PGD and its vm_index.  The parent is left
+ * with the frame and table counts it had; W bits already stripped from
+ * its entries stay off until its next write fault.
+ */
+static void cow_undo(struct exec_context *new_ctx)
+{
+    struct vm_index *cidx = vm_index_of(new_ctx);
+    if (cidx) {
+        freeAllPFNs(new_ctx, MMAP_AREA_START, MMAP_AREA_END);
+        // copied from the parent ahead of the PTEs, which may not all have made it
+        cidx->counters.zero_page_maps = 0;
+        vm_index_free(cidx);
+        new_ctx->vm_area = NULL;
+    }
+    cow_undo_table(new_ctx->pgd, 0);
+    os_pfn_free(OS_PT_REG, new_ctx->pgd);
+    new_ctx->pgd = 0;
+}
+
+static int cow_copy_mm(struct exec_context *ctx, struct exec_context *new_ctx)
+{
+    // memory segments; the stack grows down so all of it may be in use
+    for (int i = 0; i < MAX_MM_SEGS; i++) {
+        new_ctx->mms[i] = ctx->mms[i];
+        u64 end = (i == MM_SEG_STACK) ? ctx->mms[i].end : ctx->mms[i].next_free;
+        if (cow_copy_range(ctx, new_ctx, NULL, ctx->mms[i].start, end)) return -1;
+    }
+
+    // vm areas; only this file touches PTEs in the mmap window, so its
+    // PTE tables can be shared whole
+    if (cow_copy_vmas(ctx, new_ctx)) return -1;
+    if (new_ctx->vm_area &&
+        cow_copy_range(ctx, new_ctx, vm_index_of(new_ctx), MMAP_AREA_START, MMAP_AREA_END)) return -1;
+    return 0;
+}
+
  /**
   * cfork system call implemenations
   * The parent returns the pid of child process. The return path of
@@ -781,8 +2852,34 @@ long do_cfork()
     * 
     * */   
     //--------------------- Your code [start]---------------/
-      
- 
+    pid = new_ctx->pid;
+    new_ctx->ppid = ctx->pid;
+    new_ctx->type = ctx->type;
+    new_ctx->state = ctx->state;
+    new_ctx->used_mem = ctx->used_mem;
+    for (int i = 0; i < CNAME_MAX; i++)
+        new_ctx->name[i] = ctx->name[i];
+    new_ctx->regs = ctx->regs;
+    new_ctx->pending_signal_bitmap = ctx->pending_signal_bitmap;
+    for (int i = 0; i < MAX_SIGNALS; i++)
+        new_ctx->sighandlers[i] = ctx->sighandlers[i];
+    new_ctx->ticks_to_sleep = ctx->ticks_to_sleep;
+    new_ctx->alarm_config_time = ctx->alarm_config_time;
+    new_ctx->ticks_to_alarm = ctx->ticks_to_alarm;
+
+    new_ctx->pgd = os_pfn_alloc(OS_PT_REG);
+    if (!new_ctx->pgd) return -1;
+
+    // the child's vm_index setup counts its VMAs in the shared stats
+    u32 num_vm_area = stats->num_vm_area;
+    if (cow_copy_mm(ctx, new_ctx)) {
+        cow_undo(new_ctx);
+        stats->num_vm_area = num_vm_area;
+        vm_trace(ctx, VM_TRACE_CFORK, 0, 0, 0, 0, -1);
+        return -1;
+    }
+    tlb_flush_all(vm_index_of(ctx));
+    vm_trace(ctx, VM_TRACE_CFORK, 0, 0, 0, 0, pid);
     //--------------------- Your code [end] ----------------/
      
     /*
@@ -805,7 +2902,91 @@ long do_cfork()
   * should invoke this function
   * */
  
-long handle_cow_fault(struct exec_context *current, u64 vaddr, int access_flags)
+static long cow_fault(struct exec_context *current, u64 vaddr, int access_flags, struct fault_info *fi)
 {
-    return -1;
+    if (!(access_flags & PROT_WRITE)) return -1;
+
+    // tables under the mmap window carry entry counts, the segments' don't
+    struct vm_index *idx = NULL;
+    if (vaddr >= MMAP_AREA_START && vaddr < MMAP_AREA_END)
+        idx = vm_index_of(current);
+
+    // find the leaf, splitting a shared 2 MB page so only 4 KB gets copied,
+    // and one only partly writable so only the faulting page gets W
+    u64 pt_pfn[4] = { current->pgd };
+    u64 *e[4];
+    for (int level = 0; level < 4; level++) {
+        e[level] = &((u64 *)osmap(pt_pfn[level]))[(vaddr >> PT_LEVEL_SHIFT(level)) & (PTRS_PER_PT - 1)];
+        if (!(*e[level] & 1)) return -1;
+        u64 huge_start = vaddr & ~(HUGE_SIZE - 1);
+        if (level == 2 && (*e[level] & PTE_PS) && get_pfn_refcount(*e[level] >> ADDR_SHIFT) == 1 &&
+            idx && vma_range_writable(idx, huge_start, huge_start + HUGE_SIZE)) {
+            // our own 2 MB page, read-only since a lazy mprotect of all of it: keep it whole
+            pt_entry_set(idx, pt_pfn[2], e[2], *e[2] | 0x8);
+            *e[1] |= 0x8;
+            *e[0] |= 0x8;
+            if (idx) idx->counters.wp_promotions++;
+            tlb_flush_page(idx, vaddr);
+            fi->cls = FAULT_WP;
+            return 1;
+        }
+        if (level == 2 && (*e[level] & PTE_PS)) {
+            struct pt_walk w = { .ctx = current, .idx = idx };
+            if (pmd_split_huge(&w, e[level], vaddr)) {
+                fi->cls = FAULT_NOMEM;
+                return -1;
+            }
+            fi->pt_levels++;
+        }
+        if (level == 2 && pt_table_shared(e[level])) {
+            if (pt_unshare(idx, pt_pfn[2], e[level])) {
+                fi->cls = FAULT_NOMEM;
+                return -1;
+            }
+            fi->pt_levels++;
+        }
+        if (level < 3)
+            pt_pfn[level + 1] = *e[level] >> ADDR_SHIFT;
+    }
+
+    // still shared: take a private copy; last reference: just make it writable
+    u64 pfn = *e[3] >> ADDR_SHIFT;
+    if (idx && pfn == idx->zero_pfn) {
+        // nothing to copy, a zeroed frame will do
+        u64 new_pfn = frame_alloc(idx, USER_REG);
+        if (!new_pfn) {
+            fi->cls = FAULT_NOMEM;
+            return -1;
+        }
+        *e[3] = (new_pfn << ADDR_SHIFT) | (*e[3] & 0xFFF);
+        idx->counters.zero_page_maps--;
+        idx->counters.zero_page_cow++;
+        fi->cls = FAULT_COW;
+    } else if (get_pfn_refcount(pfn) > 1) {
+        u64 new_pfn = frame_alloc(idx, USER_REG);
+        if (!new_pfn) {
+            fi->cls = FAULT_NOMEM;
+            return -1;
+        }
+        page_copy(idx, new_pfn, pfn);
+        put_pfn(pfn);
+        *e[3] = (new_pfn << ADDR_SHIFT) | (*e[3] & 0xFFF);
+        fi->cls = FAULT_COW;
+    } else {
+        if (idx) idx->counters.wp_promotions++;
+        fi->cls = FAULT_WP;
+    }
+    pt_entry_set(idx, pt_pfn[3], e[3], *e[3] | 0x8);
+    pt_entry_set(idx, pt_pfn[2], e[2], *e[2] | 0x8);
+    *e[1] |= 0x8;
+    *e[0] |= 0x8;
+
+    tlb_flush_page(idx, vaddr);
+    return 1;
 }
+
+long handle_cow_fault(struct exec_context *current, u64 vaddr, int access_flags)
+{
+    struct fault_info fi = { FAULT_SPURIOUS, 0 };
+    return cow_fault(current, vaddr, access_flags, &fi);
+}
\ No newline at end of file
@@ -0,0 +1,650 @@
+/*
+ * Microbenchmarks for the vm_area_* entry points, run on the host
+ * simulation (sim.h):
+ *
+ *   cc -O2 -Ihost/include -Ihost -include sim.h \
+ *      f.c host/sim.c host/bench.c -o bench
+ *   ./bench [-l label] [-s scenario] [-n scale] [-f 1] [-t trace]
+ *
+ * Every scenario prints one tab separated row:
+ *
+ *   label scenario n ops ns/op cycles/op allocs/op pt_pages invlpg
+ *   flushes errors frames digest
+ *
+ * allocs/op counts os_pfn_alloc and os_alloc calls, pt_pages the page
+ * table frames under the mmap window when the measured phase ends (for
+ * cfork, parent and child added up, shared tables twice), and
+ * invlpg/flushes the TLB work it did.  errors counts calls that failed
+ * where the scenario expected success, so a variant that rejects a case
+ * shows up instead of looking fast.  frames is what the phase left
+ * allocated, and digest a hash of the vm_area list it left behind plus
+ * errors: variants that agree on behaviour print the same digest.
+ * Lines starting with # are comments; two runs can be compared with
+ * diff or join on the first two columns.  -s takes a scenario name or
+ * a shell pattern ("page_zero_*").  -f 1 follows each row with the
+ * measured phase's vm_area_fault_stats (vm_area.h) as # lines: faults,
+ * mean cycles and the log2 cycle histogram per class, and how many
+ * faults allocated 0 to 3+ page tables.  -t records every call into
+ * trace (see trace.h) through the variant's own vm_area_trace_* ring
+ * rather than link-time wrappers, drained as each context is torn down.
+ *
+ * Scenarios that need an f.c extension (page ops, frame pools, buddy
+ * runs) look for it through a weak reference and are skipped when the
+ * variant doesn't have it.
+ *
+ * content_check is not a benchmark but a differential test: it writes
+ * and reads values through the simulated MMU across huge pages, the
+ * zero page, mprotect, cfork and munmap, and counts every access whose
+ * result (data, or whether it faulted) differs from a simple model.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <x86intrin.h>
+
+#include "sim.h"
+#include "trace.h"
+
+#define W0        MMAP_AREA_START
+#define PAGE      4096ULL
+#define MAP_CHUNK (2ULL << 20)          /* the most the other variants take per call */
+
+long vm_area_set_page_ops(struct exec_context *current, u64 zero_op, u64 copy_op) __attribute__((weak));
+long vm_area_zero_pool_refill(struct exec_context *current, u64 frames) __attribute__((weak));
+void vm_area_zero_pool_drain(struct exec_context *current) __attribute__((weak));
+u64 vm_area_alloc_run(struct exec_context *current, u64 order) __attribute__((weak));
+long vm_area_free_run(struct exec_context *current, u64 pfn, u64 order) __attribute__((weak));
+long vm_area_buddy_unusable(struct exec_context *current, u64 order) __attribute__((weak));
+struct vm_fault_stats *vm_area_fault_stats(struct exec_context *current) __attribute__((weak));
+void vm_area_exit(struct exec_context *current) __attribute__((weak));
+struct vm_counters *vm_area_counters(struct exec_context *current) __attribute__((weak));
+long vm_area_trace_start(struct exec_context *current, u64 pages) __attribute__((weak));
+long vm_area_trace_read(struct exec_context *current, struct vm_trace_rec *buf, u64 max) __attribute__((weak));
+
+struct bench {
+    const char *name;
+    u64 n;
+    u64 ops;
+    u64 errors;
+    struct exec_context *ctx;           /* whose page tables pt_pages looks at */
+    struct sim_counters c0;
+    u64 ns0, tsc0;
+    u64 ns, cycles;
+    struct sim_counters c1;
+    u64 pt_pages;
+    u64 digest;
+    struct vm_fault_stats fs0;          /* ctx's fault stats when the phase started */
+};
+
+static const char *label = "f.c";
+static const char *only;
+static u64 scale = 1;
+static int fault_stats;
+static struct trace_file ktrace;        /* -t: where the vm_area_trace_* records go */
+static u64 rng_state = 0x9E3779B97F4A7C15ULL;
+
+static u64 rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static u64 now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int wanted(const char *name)
+{
+    return !only || !fnmatch(only, name, 0);
+}
+
+static void bench_start(struct bench *b, const char *name, u64 n, struct exec_context *ctx)
+{
+    memset(b, 0, sizeof(*b));
+    b->name = name;
+    b->n = n;
+    b->ctx = ctx;
+    if (fault_stats && ctx && vm_area_fault_stats && vm_area_fault_stats(ctx))
+        b->fs0 = *vm_area_fault_stats(ctx);
+    b->c0 = sim;
+    b->ns0 = now_ns();
+    b->tsc0 = __rdtsc();
+}
+
+static void bench_stop(struct bench *b)
+{
+    b->cycles = __rdtsc() - b->tsc0;
+    b->ns = now_ns() - b->ns0;
+    b->c1 = sim;
+    b->pt_pages = b->ctx ? sim_pt_pages(b->ctx, MMAP_AREA_START, MMAP_AREA_END) : 0;
+
+    /* FNV-1a over errors and every vm_area's start, end and flags */
+    u64 h = (0xcbf29ce484222325ULL ^ b->errors) * 0x100000001b3ULL, words[3];
+    for (struct vm_area *v = b->ctx ? b->ctx->vm_area : NULL; v; v = v->vm_next) {
+        words[0] = v->vm_start;
+        words[1] = v->vm_end;
+        words[2] = v->access_flags;
+        for (int i = 0; i < 3; i++)
+            h = (h ^ words[i]) * 0x100000001b3ULL;
+    }
+    b->digest = h;
+}
+
+static void bench_report(struct bench *b)
+{
+    u64 ops = b->ops ? b->ops : 1;
+    u64 allocs = (b->c1.pfn_allocs - b->c0.pfn_allocs) + (b->c1.os_allocs - b->c0.os_allocs);
+    printf("%s\t%s\t%llu\t%llu\t%.1f\t%.1f\t%.3f\t%llu\t%llu\t%llu\t%llu\t%lld\t%016llx\n",
+           label, b->name, b->n, b->ops, (double)b->ns / ops, (double)b->cycles / ops,
+           (double)allocs / ops, b->pt_pages, b->c1.invlpg - b->c0.invlpg,
+           b->c1.tlb_flushes - b->c0.tlb_flushes, b->errors,
+           (long long)(b->c1.frames_live - b->c0.frames_live), b->digest);
+    if (fault_stats && b->ctx && vm_area_fault_stats && vm_area_fault_stats(b->ctx)) {
+        struct vm_fault_stats fs = *vm_area_fault_stats(b->ctx);
+        char prefix[128];
+        for (int c = 0; c < FAULT_CLASSES; c++) {
+            fs.faults[c] -= b->fs0.faults[c];
+            fs.cycles[c] -= b->fs0.cycles[c];
+            for (int n = 0; n < FAULT_HIST_BUCKETS; n++)
+                fs.hist[c][n] -= b->fs0.hist[c][n];
+        }
+        for (int n = 0; n < FAULT_PT_LEVELS; n++)
+            fs.pt_levels[n] -= b->fs0.pt_levels[n];
+        snprintf(prefix, sizeof(prefix), "%s %s", label, b->name);
+        sim_print_fault_stats(prefix, &fs);
+    }
+    fflush(stdout);
+}
+
+/*
+ * The sim arena is zero-filled lazily by the host; touch the frames the
+ * scenarios will use so the first one doesn't pay for host page faults.
+ */
+static void warm_arena(void)
+{
+    static u64 pfns[1 << 16];
+    for (u32 region = USER_REG; region <= OS_PT_REG; region++) {
+        u64 n = region == USER_REG ? 1 << 16 : 1 << 12;
+        for (u64 i = 0; i < n; i++)
+            pfns[i] = os_pfn_alloc(region);
+        for (u64 i = 0; i < n; i++)
+            if (pfns[i]) os_pfn_free(region, pfns[i]);
+    }
+}
+
+/*
+ * A new process with its vm index already set up: the first call into
+ * a context allocates it, which no scenario means to time.  The page
+ * at the bottom of the window stays mapped.
+ */
+static struct exec_context *fresh(void)
+{
+    struct exec_context *ctx = sim_new_process();
+    if (getenv("BENCH_DUMMY_VMA")) sim_dummy_vma(ctx);
+    if (ktrace.f) vm_area_trace_start(ctx, 512);
+    vm_area_map(ctx, W0, PAGE, PROT_READ, MAP_FIXED);
+    return ctx;
+}
+
+/* map [addr, addr + len) in chunks every variant accepts; returns failed calls */
+static u64 map_range(struct exec_context *ctx, u64 addr, u64 len, int prot)
+{
+    u64 errors = 0;
+    for (u64 off = 0; off < len; off += MAP_CHUNK) {
+        u64 n = len - off < MAP_CHUNK ? len - off : MAP_CHUNK;
+        if (vm_area_map(ctx, addr + off, n, prot, MAP_FIXED) != (long)(addr + off)) errors++;
+    }
+    return errors;
+}
+
+static u64 unmap_range(struct exec_context *ctx, u64 addr, u64 len)
+{
+    u64 errors = 0;
+    for (u64 off = 0; off < len; off += MAP_CHUNK) {
+        u64 n = len - off < MAP_CHUNK ? len - off : MAP_CHUNK;
+        if (vm_area_unmap(ctx, addr + off, n) < 0) errors++;
+    }
+    return errors;
+}
+
+static u64 fault_range(struct exec_context *ctx, u64 addr, u64 pages, int error_code)
+{
+    u64 errors = 0;
+    for (u64 i = 0; i < pages; i++)
+        if (vm_area_pagefault(ctx, addr + i * PAGE, error_code) != 1) errors++;
+    return errors;
+}
+
+/* write out what ctx's trace ring holds; a cfork child drains its parent's too */
+static void trace_drain(struct exec_context *ctx)
+{
+    struct vm_trace_rec buf[256];
+    long n;
+    while ((n = vm_area_trace_read(ctx, buf, 256)) > 0) {
+        for (long i = 0; i < n; i++) {
+            struct trace_rec r = { buf[i].op, buf[i].pid, buf[i].addr, buf[i].length,
+                                   buf[i].prot, buf[i].flags, buf[i].result };
+            trace_write(&ktrace, &r);
+        }
+    }
+    struct vm_counters *vc = vm_area_counters ? vm_area_counters(ctx) : NULL;
+    if (vc && vc->trace_dropped)
+        fprintf(stderr, "bench: %llu trace records dropped\n", vc->trace_dropped);
+}
+
+/* unmap the whole window, fresh()'s page included, and let the variant free the rest */
+static void teardown(struct exec_context *ctx)
+{
+    unmap_range(ctx, W0, MMAP_AREA_END - W0);
+    if (ktrace.f) trace_drain(ctx);
+    if (vm_area_exit) vm_area_exit(ctx);
+}
+
+/* n one-page mappings with a hole between each, so nothing merges */
+static void bench_map_scattered(u64 n)
+{
+    struct bench b;
+    struct exec_context *ctx = fresh();
+    if (wanted("map_scattered")) {
+        bench_start(&b, "map_scattered", n, ctx);
+        for (u64 i = 0; i < n; i++)
+            if (vm_area_map(ctx, W0 + (2 * i + 2) * PAGE, PAGE, PROT_READ | PROT_WRITE, 0) < 0) b.errors++;
+        b.ops = n;
+        bench_stop(&b);
+        bench_report(&b);
+    }
+    if (wanted("unmap_scattered")) {
+        bench_start(&b, "unmap_scattered", n, ctx);
+        for (u64 i = 0; i < n; i++) {
+            u64 j = (i * 7919) % n;     /* not in address order */
+            if (vm_area_unmap(ctx, W0 + (2 * j + 2) * PAGE, PAGE) < 0) b.errors++;
+        }
+        b.ops = n;
+        bench_stop(&b);
+        bench_report(&b);
+    }
+    teardown(ctx);
+}
+
+static void bench_fault(const char *name, u64 pages, int random)
+{
+    if (!wanted(name)) return;
+    struct bench b;
+    struct exec_context *ctx = fresh();
+    u64 base = W0 + MAP_CHUNK, *order = malloc(pages * sizeof(*order));
+    for (u64 i = 0; i < pages; i++)
+        order[i] = i;
+    for (u64 i = pages - 1; random && i > 0; i--) {
+        u64 j = rng() % (i + 1), t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+    u64 map_errors = map_range(ctx, base, pages * PAGE, PROT_READ | PROT_WRITE);
+
+    bench_start(&b, name, pages, ctx);
+    b.errors = map_errors;
+    for (u64 i = 0; i < pages; i++)
+        if (vm_area_pagefault(ctx, base + order[i] * PAGE, 0x6) != 1) b.errors++;
+    b.ops = pages;
+    bench_stop(&b);
+    bench_report(&b);
+    free(order);
+    teardown(ctx);
+}
+
+/* n interior mprotects, each cutting a mapping in three */
+static void bench_mprotect_split(u64 n)
+{
+    if (!wanted("mprotect_split")) return;
+    struct bench b;
+    struct exec_context *ctx = fresh();
+    u64 base = W0 + MAP_CHUNK, len = (2 * n + 1) * PAGE;
+    u64 map_errors = map_range(ctx, base, len, PROT_READ | PROT_WRITE);
+
+    bench_start(&b, "mprotect_split", n, ctx);
+    b.errors = map_errors;
+    for (u64 i = 0; i < n; i++)
+        if (vm_area_mprotect(ctx, base + (2 * i + 1) * PAGE, PAGE, PROT_READ) < 0) b.errors++;
+    b.ops = n;
+    bench_stop(&b);
+    bench_report(&b);
+    teardown(ctx);
+}
+
+/* unmap a fully faulted range; ops are pages */
+static void bench_munmap_large(u64 pages)
+{
+    if (!wanted("munmap_large")) return;
+    struct bench b;
+    struct exec_context *ctx = fresh();
+    u64 base = W0 + MAP_CHUNK;
+    u64 errors = map_range(ctx, base, pages * PAGE, PROT_READ | PROT_WRITE);
+    errors += fault_range(ctx, base, pages, 0x6);
+
+    bench_start(&b, "munmap_large", pages, ctx);
+    b.errors = errors + unmap_range(ctx, base, pages * PAGE);
+    b.ops = pages;
+    bench_stop(&b);
+    bench_report(&b);
+    teardown(ctx);
+}
+
+/* cfork with the given pages faulted, either packed together or one per 2 MB */
+static void bench_cfork(const char *name, u64 pages, int sparse)
+{
+    if (!wanted(name)) return;
+    struct bench b;
+    struct exec_context *ctx = fresh();
+    u64 base = W0 + MAP_CHUNK, errors = 0;
+    if (sparse) {
+        for (u64 i = 0; i < pages; i++) {
+            u64 va = base + i * MAP_CHUNK;
+            if (vm_area_map(ctx, va, PAGE, PROT_READ | PROT_WRITE, MAP_FIXED) != (long)va) errors++;
+            if (vm_area_pagefault(ctx, va, 0x6) != 1) errors++;
+        }
+    } else {
+        errors += map_range(ctx, base, pages * PAGE, PROT_READ | PROT_WRITE);
+        errors += fault_range(ctx, base, pages, 0x6);
+    }
+
+    sim_set_current(ctx);
+    bench_start(&b, name, pages, ctx);
+    b.errors = errors;
+    long pid = do_cfork();
+    if (pid <= 0) b.errors++;
+    b.ops = 1;
+    bench_stop(&b);
+    struct exec_context *child = pid > 0 ? sim_ctx_by_pid(pid) : NULL;
+    if (child) b.pt_pages += sim_pt_pages(child, MMAP_AREA_START, MMAP_AREA_END);
+    bench_report(&b);
+    if (child) teardown(child);
+    teardown(ctx);
+}
+
+/* mmap of len bytes with nothing touched, then munmap: should not depend on len */
+static void bench_reserve(const char *name, u64 len)
+{
+    if (!wanted(name)) return;
+    struct bench b;
+    struct exec_context *ctx = fresh();
+    bench_start(&b, name, len / PAGE, ctx);
+    for (b.ops = 0; b.ops < 64; b.ops++) {
+        long r = vm_area_map(ctx, 0, len, PROT_READ | PROT_WRITE, 0);
+        if (r < 0 || vm_area_unmap(ctx, r, len) < 0) b.errors++;
+    }
+    bench_stop(&b);
+    bench_report(&b);
+    teardown(ctx);
+}
+
+static const char *page_op_names[] = { "loop", "rep", "sse2", "avx2", "nt" };
+
+/*
+ * Zeroing goes through the pool refill (allocate + zero, per frame) and
+ * copying through CoW breaks after a cfork (allocate + copy, per page),
+ * so both rows include the same allocator overhead for every kernel.
+ */
+static void bench_page_ops(u64 pages)
+{
+    if (!vm_area_set_page_ops || !vm_area_zero_pool_refill || !vm_area_zero_pool_drain) return;
+    for (u64 op = 0; op < sizeof(page_op_names) / sizeof(page_op_names[0]); op++) {
+        char name[32];
+        struct bench b;
+        struct exec_context *ctx = fresh();
+        if (vm_area_set_page_ops(ctx, op, op) < 0) continue;
+
+        snprintf(name, sizeof(name), "page_zero_%s", page_op_names[op]);
+        if (wanted(name)) {
+            bench_start(&b, name, pages, ctx);
+            for (u64 done = 0; done < pages; ) {
+                long added = vm_area_zero_pool_refill(ctx, 32);
+                if (added <= 0) {
+                    b.errors++;
+                    break;
+                }
+                done += added;
+                b.ops += added;
+                vm_area_zero_pool_drain(ctx);
+            }
+            bench_stop(&b);
+            bench_report(&b);
+        }
+
+        snprintf(name, sizeof(name), "page_copy_%s", page_op_names[op]);
+        if (wanted(name)) {
+            u64 base = W0 + MAP_CHUNK;
+            u64 errors = map_range(ctx, base, pages * PAGE, PROT_READ | PROT_WRITE);
+            errors += fault_range(ctx, base, pages, 0x6);
+            sim_set_current(ctx);
+            long pid = do_cfork();
+            bench_start(&b, name, pages, ctx);
+            b.errors = errors + (pid <= 0);
+            b.errors += fault_range(ctx, base, pages, 0x7);
+            b.ops = pages;
+            bench_stop(&b);
+            bench_report(&b);
+            struct exec_context *child = pid > 0 ? sim_ctx_by_pid(pid) : NULL;
+            if (child) teardown(child);
+        }
+        teardown(ctx);
+    }
+}
+
+/* random run allocations and frees; reports the order-9 unusable index at the end */
+static void bench_buddy(u64 n)
+{
+    if (!vm_area_alloc_run || !vm_area_free_run || !wanted("buddy_stress")) return;
+    struct bench b;
+    struct exec_context *ctx = fresh();
+    u64 live_pfn[256], live_order[256], live = 0;
+
+    bench_start(&b, "buddy_stress", n, ctx);
+    for (u64 i = 0; i < n; i++) {
+        if (live < 256 && (live == 0 || rng() % 3)) {
+            // half the runs order 0, a quarter order 1 and so on, the rest order 9
+            u64 order = __builtin_ctzll(rng() | 1ULL << 9);
+            u64 pfn = vm_area_alloc_run(ctx, order);
+            if (!pfn) {
+                b.errors++;
+                continue;
+            }
+            live_pfn[live] = pfn;
+            live_order[live++] = order;
+        } else {
+            u64 j = rng() % live;
+            vm_area_free_run(ctx, live_pfn[j], live_order[j]);
+            live_pfn[j] = live_pfn[--live];
+            live_order[j] = live_order[live];
+        }
+    }
+    b.ops = n;
+    bench_stop(&b);
+    bench_report(&b);
+    if (vm_area_buddy_unusable)
+        printf("# %s buddy_stress unusable(order 9) %ld/1000 with %llu runs live\n",
+               label, vm_area_buddy_unusable(ctx, 9), live);
+    if (vm_area_counters && vm_area_counters(ctx)) {
+        struct vm_counters *vc = vm_area_counters(ctx);
+        printf("# %s buddy_stress %llu splits, %llu merges, %llu arenas grabbed, %llu held\n",
+               label, vc->buddy_splits, vc->buddy_merges, vc->buddy_grabs, vc->buddy_arenas);
+    }
+    while (live--)
+        vm_area_free_run(ctx, live_pfn[live], live_order[live]);
+    teardown(ctx);
+}
+
+/*
+ * What each page of the checked range should hold, per process: prot 0
+ * is unmapped, and a page never written reads as 0.  One word per page
+ * is used, at an offset that varies with the page.
+ */
+#define CHECK_PAGES (2 * 512 + 256)     /* two whole 2 MB slots and part of a third */
+
+struct content_model {
+    u8 prot[CHECK_PAGES];
+    u64 val[CHECK_PAGES];
+};
+
+static u64 check_base;
+
+static u64 check_va(u64 page)
+{
+    return check_base + page * PAGE + (page % 512) * 8;
+}
+
+/* make va accessible the way the MMU would, faulting first; 0 if the access may go ahead */
+static int touch(struct exec_context *ctx, u64 va, int write)
+{
+    int code = 0;
+    sim_set_current(ctx);
+    if (!sim_leaf(ctx, va)) code = write ? 0x6 : 0x4;
+    else if (write && !sim_writable(ctx, va)) code = 0x7;
+    if (code && vm_area_pagefault(ctx, va, code) != 1) return -1;
+    if (!sim_leaf(ctx, va) || (write && !sim_writable(ctx, va))) return -1;
+    return 0;
+}
+
+/* one access to a page; a write first checks that the fault kept what was there */
+static void check_access(struct bench *b, struct exec_context *ctx, struct content_model *m,
+                         u64 page, int write, u64 v)
+{
+    u64 va = check_va(page);
+    int allowed = write ? m->prot[page] == (PROT_READ | PROT_WRITE) : m->prot[page] != 0;
+    b->ops++;
+    if ((touch(ctx, va, write) == 0) != allowed) {
+        b->errors++;
+        return;
+    }
+    if (!allowed) return;
+    u64 *p = (u64 *)((char *)osmap(sim_frame(ctx, va)) + (va & (PAGE - 1)));
+    if (*p != m->val[page]) b->errors++;
+    if (write) *p = m->val[page] = v;
+}
+
+static void check_sweep(struct bench *b, struct exec_context *ctx, struct content_model *m)
+{
+    for (u64 i = 0; i < CHECK_PAGES; i++)
+        check_access(b, ctx, m, i, 0, 0);
+}
+
+static void check_mprotect(struct bench *b, struct exec_context *ctx, struct content_model *m,
+                           u64 first, u64 pages, int prot)
+{
+    if (vm_area_mprotect(ctx, check_va(first) & ~(PAGE - 1), pages * PAGE, prot) < 0) b->errors++;
+    for (u64 i = first; i < first + pages; i++)
+        m->prot[i] = prot;
+}
+
+static void bench_content(void)
+{
+    if (!wanted("content_check")) return;
+    static struct content_model pm, cm;
+    struct bench b;
+    struct exec_context *ctx = fresh(), *child = NULL;
+    check_base = W0 + MAP_CHUNK;
+    memset(&pm, 0, sizeof(pm));
+
+    bench_start(&b, "content_check", CHECK_PAGES, ctx);
+    b.errors = map_range(ctx, check_base, CHECK_PAGES * PAGE, PROT_READ | PROT_WRITE);
+    for (u64 i = 0; i < CHECK_PAGES; i++)
+        pm.prot[i] = PROT_READ | PROT_WRITE;
+
+    /* slot 0 written from its first page (a 2 MB page where there are
+       any), the rest read first so it sits on the zero page */
+    for (u64 i = 0; i < 512; i++)
+        check_access(&b, ctx, &pm, i, 1, 0x1000000 + i);
+    for (u64 i = 512; i < CHECK_PAGES; i++)
+        check_access(&b, ctx, &pm, i, 0, 0);
+
+    /* unmap part of the zero-page slot; a new write fault elsewhere must
+       not get a frame the rest still maps */
+    if (unmap_range(ctx, check_base + 512 * PAGE, 200 * PAGE)) b.errors++;
+    for (u64 i = 512; i < 712; i++)
+        pm.prot[i] = 0;
+    u64 other = check_base + 16 * MAP_CHUNK;
+    if (vm_area_map(ctx, other, 8 * PAGE, PROT_READ | PROT_WRITE, MAP_FIXED) != (long)other) b.errors++;
+    for (u64 i = 0; i < 8; i++) {
+        b.ops++;
+        if (touch(ctx, other + i * PAGE, 1)) b.errors++;
+        else *(u64 *)osmap(sim_frame(ctx, other + i * PAGE)) = 0xdeadbeef;
+    }
+    check_sweep(&b, ctx, &pm);
+    for (u64 i = 712; i < CHECK_PAGES; i += 3)
+        check_access(&b, ctx, &pm, i, 1, 0x2000000 + i);
+
+    /* slot 0 read-only, then half of it writable again: the other half must stay read-only */
+    check_mprotect(&b, ctx, &pm, 0, 512, PROT_READ);
+    check_access(&b, ctx, &pm, 300, 1, 1);
+    check_mprotect(&b, ctx, &pm, 0, 256, PROT_READ | PROT_WRITE);
+    check_access(&b, ctx, &pm, 10, 1, 0x3000000 + 10);
+    check_access(&b, ctx, &pm, 300, 1, 1);
+    check_access(&b, ctx, &pm, 400, 1, 1);
+
+    /* cfork: each side's writes must stay its own */
+    long pid = do_cfork();
+    child = pid > 0 ? sim_ctx_by_pid(pid) : NULL;
+    if (child) {
+        cm = pm;
+        for (u64 i = 0; i < CHECK_PAGES; i += 5)
+            check_access(&b, ctx, &pm, i, pm.prot[i] & PROT_WRITE, 0x4000000 + i);
+        check_sweep(&b, child, &cm);
+        for (u64 i = 1; i < CHECK_PAGES; i += 7)
+            check_access(&b, child, &cm, i, cm.prot[i] & PROT_WRITE, 0x5000000 + i);
+        check_sweep(&b, ctx, &pm);
+        check_sweep(&b, child, &cm);
+    } else {
+        b.errors++;
+    }
+
+    bench_stop(&b);
+    bench_report(&b);
+    if (child) teardown(child);
+    teardown(ctx);
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (!strcmp(argv[i], "-l")) label = argv[i + 1];
+        else if (!strcmp(argv[i], "-s")) only = argv[i + 1];
+        else if (!strcmp(argv[i], "-n")) scale = strtoull(argv[i + 1], NULL, 0);
+        else if (!strcmp(argv[i], "-f")) fault_stats = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "-t")) ktrace.f = fopen(argv[i + 1], "wb");
+        else {
+            fprintf(stderr, "usage: %s [-l label] [-s scenario] [-n scale] [-f 1] [-t trace]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (ktrace.f && !vm_area_trace_start) {
+        fprintf(stderr, "bench: %s has no vm_area_trace_start\n", label);
+        return 2;
+    }
+    if (ktrace.f) {
+        fwrite(TRACE_MAGIC, 1, 4, ktrace.f);
+        fputc(TRACE_VERSION, ktrace.f);
+    }
+
+    warm_arena();
+    printf("# label\tscenario\tn\tops\tns/op\tcycles/op\tallocs/op\tpt_pages\tinvlpg\tflushes\terrors\tframes\tdigest\n");
+    bench_map_scattered(1000 * scale);
+    bench_fault("fault_seq", 4096 * scale, 0);
+    bench_fault("fault_rand", 4096 * scale, 1);
+    bench_mprotect_split(1000 * scale);
+    bench_munmap_large(16384 * scale);
+    bench_cfork("cfork_sparse", 256 * scale, 1);
+    bench_cfork("cfork_dense", 16384 * scale, 0);
+    bench_reserve("reserve_2m", 2ULL << 20);
+    bench_reserve("reserve_64m", 64ULL << 20);
+    bench_reserve("reserve_1g", 1ULL << 30);
+    bench_page_ops(4096 * scale);
+    bench_buddy(20000 * scale);
+    bench_content();
+    return 0;
+}
@@ -0,0 +1,154 @@
+#!/bin/sh
+#
+# Build every vm_area variant against the host sim and run host/bench.c
+# on each, one scenario per process, then print the results side by side
+# and flag where a variant behaves differently from f.c.
+#
+#   host/compare.sh [-n scale] [-t seconds] [-o dir] [variant ...]
+#
+# Variants are named without .c; f is always run, it is the reference.
+#
+# Run from the repository root.  Each scenario gets -t seconds (default
+# 20); some variants loop forever in cfork or unmap, those show up as
+# "timeout", and a scenario that dies shows up as "crash" (or "teardown
+# timeout/crash" when its numbers were already printed).  A variant
+# that doesn't build is reported with its first compiler error.  The raw
+# TSV rows from bench end up in dir (default /tmp/vm-compare), one file
+# per variant.
+#
+# Divergences are reported against f.c: a different errors count or a
+# different vm_area list (the digest column) for the same scenario.
+# Scenarios a variant skips (the f.c-only extensions) are left blank.
+
+CC=${CC:-cc}
+SCALE=1
+LIMIT=20
+OUT=/tmp/vm-compare
+
+while getopts n:t:o: opt; do
+    case $opt in
+    n) SCALE=$OPTARG ;;
+    t) LIMIT=$OPTARG ;;
+    o) OUT=$OPTARG ;;
+    *) sed -n '7p' "$0"; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+REF=f
+VARIANTS=${*:-"v2p v2p1 part1 part1gpt10 part1initial finalpart1"}
+VARIANTS="$REF $(echo $VARIANTS | tr ' ' '\n' | grep -vx $REF | tr '\n' ' ')"
+
+mkdir -p "$OUT" || exit 1
+
+# per-variant build flags and environment for the bench run
+cflags() {
+    case $1 in
+    part1gpt10) echo "-DERR_CODE_READ=0x4 -DERR_CODE_WRITE=0x6 -DERR_CODE_PROT=0x7 -DSIM_PTE_W=0x2" ;;
+    v2p|v2p1) echo "-DSIM_PTE_W=0x2" ;;         # x86's R/W bit, not f.c's 0x8
+    esac
+}
+
+runenv() {
+    case $1 in
+    v2p|v2p1|part1gpt10) echo "BENCH_DUMMY_VMA=1" ;;   # these expect the dummy head gemOS sets up
+    esac
+}
+
+build() {
+    $CC -std=gnu11 -O2 -w -Ihost/include -Ihost -include sim.h $(cflags "$1") \
+        "$1.c" host/sim.c host/bench.c -o "$OUT/bench-$1" 2> "$OUT/$1.cc.log"
+}
+
+# the scenario list comes from a full run of the reference build
+if ! build $REF; then
+    echo "compare: the reference $REF.c does not build:" >&2
+    grep -m1 error "$OUT/$REF.cc.log" >&2
+    exit 1
+fi
+SCENARIOS=$("$OUT/bench-$REF" -n "$SCALE" | awk -F'\t' '!/^#/ { print $2 }')
+
+for v in $VARIANTS; do
+    res="$OUT/$v.tsv"
+    : > "$res"
+    if [ "$v" != $REF ] && ! build "$v"; then
+        printf '%s\t-\tbuild\t%s\n' "$v" "$(grep -m1 error "$OUT/$v.cc.log")" >> "$res"
+        echo "$v: does not build" >&2
+        continue
+    fi
+    for s in $SCENARIOS; do
+        env $(runenv "$v") timeout "$LIMIT" "$OUT/bench-$v" -l "$v" -n "$SCALE" -s "$s" \
+            > "$OUT/run.tsv" 2> /dev/null
+        rc=$?
+        # a row printed before the failure means only the teardown failed
+        fail=
+        [ $rc -eq 124 ] && fail=timeout
+        [ $rc -ne 0 ] && [ -z "$fail" ] && fail=crash
+        if grep -v '^#' "$OUT/run.tsv" >> "$res"; then
+            [ -n "$fail" ] && fail="teardown $fail"
+        fi
+        [ -n "$fail" ] && printf '%s\t%s\t%s\n' "$v" "$s" "$fail" >> "$res"
+        :
+    done
+    echo "$v: done" >&2
+done
+
+# side by side tables and the divergence list
+for v in $VARIANTS; do cat "$OUT/$v.tsv"; done | awk -F'\t' -v variants="$VARIANTS" -v ref=$REF '
+function table(title, col, fmt,    i, s, v, key) {
+    printf "\n%s\n%-18s", title, "scenario"
+    for (i = 1; i <= nv; i++) printf " %12s", var[i]
+    printf "\n"
+    for (s = 1; s <= ns; s++) {
+        printf "%-18s", scen[s]
+        for (i = 1; i <= nv; i++) {
+            key = var[i] SUBSEP scen[s]
+            if (key in status)      printf " %12s", status[key]
+            else if (key in row)    printf " " fmt, field[key, col]
+            else                    printf " %12s", "-"
+        }
+        printf "\n"
+    }
+}
+BEGIN { nv = split(variants, var, " ") }
+$2 == "-" { broken[$1] = $4; next }
+{
+    key = $1 SUBSEP $2
+    if (!($2 in seen)) { seen[$2] = 1; scen[++ns] = $2 }
+    if (NF == 3 && $3 ~ /^teardown/) { note[key] = $3; next }
+    if (NF == 3) { status[key] = $3; next }
+    row[key] = 1
+    for (i = 1; i <= NF; i++) field[key, i] = $i
+}
+END {
+    for (i = 1; i <= nv; i++)
+        if (var[i] in broken) printf "%s: does not build: %s\n", var[i], broken[var[i]]
+    table("ns/op", 5, "%12.1f")
+    table("allocs/op", 7, "%12.3f")
+    table("pt pages", 8, "%12d")
+    table("invlpg", 9, "%12d")
+    table("frames left", 12, "%12d")
+
+    printf "\ndivergences from %s\n", ref
+    n = 0
+    for (s = 1; s <= ns; s++) {
+        rk = ref SUBSEP scen[s]
+        if (!(rk in row)) continue
+        for (i = 1; i <= nv; i++) {
+            v = var[i]
+            key = v SUBSEP scen[s]
+            if (v == ref || v in broken) continue
+            if (key in note) {
+                printf "  %-12s %-18s %s\n", v, scen[s], note[key]; n++
+            }
+            if (key in status) {
+                printf "  %-12s %-18s %s\n", v, scen[s], status[key]; n++
+            } else if (key in row && field[key, 11] != field[rk, 11]) {
+                printf "  %-12s %-18s errors %s, %s has %s\n", v, scen[s], field[key, 11], ref, field[rk, 11]; n++
+            } else if (key in row && field[key, 13] != field[rk, 13]) {
+                printf "  %-12s %-18s different vm_area list\n", v, scen[s]; n++
+            }
+        }
+    }
+    if (!n) printf "  none\n"
+}'
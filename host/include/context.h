@@ -0,0 +1,61 @@
+/*
+ * Host build: stand-in for gemOS include/context.h.  The exec_context
+ * carries every field the vm code and do_cfork copy; the register and
+ * signal state are opaque placeholders.
+ */
+#ifndef __CONTEXT_H_
+#define __CONTEXT_H_
+
+#include <types.h>
+
+#define EINVAL 22
+#define ENOMEM 12
+
+#define MAX_MM_SEGS    4
+#define MM_SEG_CODE    0
+#define MM_SEG_RODATA  1
+#define MM_SEG_DATA    2
+#define MM_SEG_STACK   3
+
+#define CNAME_MAX      64
+#define MAX_SIGNALS    8
+#define MAX_OPEN_FILES 16
+
+struct mm_segment {
+    unsigned long start;
+    unsigned long end;
+    unsigned long next_free;
+    u32 access_flags;
+};
+
+struct user_regs {
+    u64 rip;
+    u64 rsp;
+    u64 rax;
+};
+
+struct vm_area;
+
+struct exec_context {
+    u32 pid;
+    u32 ppid;
+    u8 type;
+    u8 state;
+    u16 used_mem;
+    u32 pgd;
+    struct mm_segment mms[MAX_MM_SEGS];
+    struct vm_area *vm_area;
+    char name[CNAME_MAX];
+    struct user_regs regs;
+    u32 pending_signal_bitmap;
+    void *sighandlers[MAX_SIGNALS];
+    u32 ticks_to_sleep;
+    u32 alarm_config_time;
+    u32 ticks_to_alarm;
+    void *files[MAX_OPEN_FILES];
+};
+
+extern struct exec_context *get_current_ctx(void);
+extern struct exec_context *get_new_ctx(void);
+
+#endif
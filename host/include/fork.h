@@ -0,0 +1,13 @@
+/* Host build: stand-in for gemOS include/fork.h. */
+#ifndef __FORK_H_
+#define __FORK_H_
+
+#include <context.h>
+
+extern long do_cfork(void);
+extern long handle_cow_fault(struct exec_context *current, u64 vaddr, int access_flags);
+extern void copy_os_pts(u64 src, u64 dst);
+extern void do_file_fork(struct exec_context *child);
+extern void setup_child_context(struct exec_context *child);
+
+#endif
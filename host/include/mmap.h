@@ -0,0 +1,35 @@
+/* Host build: stand-in for gemOS include/mmap.h. */
+#ifndef __MMAP_H_
+#define __MMAP_H_
+
+#include <types.h>
+#include <context.h>
+#include <page.h>
+
+#define MMAP_AREA_START 0x180000000ULL
+#define MMAP_AREA_END   0x200000000ULL
+
+#define PROT_READ  0x1
+#define PROT_WRITE 0x2
+
+#define MAP_FIXED  0x1
+
+struct vm_area {
+    u64 vm_start;
+    u64 vm_end;
+    u32 access_flags;
+    struct vm_area *vm_next;
+};
+
+struct vm_area_stats {
+    u32 num_vm_area;
+};
+
+extern struct vm_area_stats *stats;
+
+extern long vm_area_map(struct exec_context *current, u64 addr, int length, int prot, int flags);
+extern long vm_area_unmap(struct exec_context *current, u64 addr, int length);
+extern long vm_area_mprotect(struct exec_context *current, u64 addr, int length, int prot);
+extern long vm_area_pagefault(struct exec_context *current, u64 addr, int error_code);
+
+#endif
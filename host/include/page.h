@@ -0,0 +1,34 @@
+/*
+ * Host build: stand-in for gemOS include/page.h.  Frames live in an
+ * arena in host/sim.c; osmap() returns a pointer into it.
+ *
+ * The kernel code issues invlpg and reloads CR3, which would fault in
+ * user space.  f.c routes both through arch_invlpg()/arch_flush_tlb(),
+ * which it only defines when nobody else has, so the host build counts
+ * them instead.
+ */
+#ifndef __PAGE_H_
+#define __PAGE_H_
+
+#include <types.h>
+
+#define OS_DS_REG 0
+#define USER_REG  1
+#define OS_PT_REG 2
+
+extern void *osmap(u64 pfn);
+extern u32 os_pfn_alloc(u32 region);
+extern void os_pfn_free(u32 region, u64 pfn);
+extern void *os_alloc(u32 size);
+extern void os_free(void *ptr, u32 size);
+extern u64 get_pfn(u64 pfn);
+extern u64 put_pfn(u64 pfn);
+extern s8 get_pfn_refcount(u64 pfn);
+extern int printk(const char *fmt, ...);
+
+extern void sim_invlpg(u64 addr);
+extern void sim_flush_tlb(void);
+#define arch_invlpg(addr) sim_invlpg(addr)
+#define arch_flush_tlb()  sim_flush_tlb()
+
+#endif
@@ -0,0 +1,5 @@
+/*
+ * Host build: gemOS has its own string.h; the C library's covers what
+ * v2p.c and v2p1.c use from it.
+ */
+#include_next <string.h>
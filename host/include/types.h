@@ -0,0 +1,19 @@
+/*
+ * Host build: stand-in for gemOS include/types.h.  Only what the vm
+ * code in this repo uses.
+ */
+#ifndef __TYPES_H_
+#define __TYPES_H_
+
+#include <stddef.h>
+
+typedef unsigned long long u64;
+typedef unsigned int u32;
+typedef unsigned short u16;
+typedef unsigned char u8;
+typedef long long s64;
+typedef int s32;
+typedef short s16;
+typedef char s8;
+
+#endif
@@ -0,0 +1,11 @@
+/* Host build: stand-in for gemOS include/v2p.h. */
+#ifndef __V2P_H_
+#define __V2P_H_
+
+#include <mmap.h>
+#include <fork.h>
+
+/* the PTE slot for addr if all the tables above it exist, else NULL; dump prints the walk */
+extern u64 *get_user_pte(struct exec_context *ctx, u64 addr, int dump);
+
+#endif
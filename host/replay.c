@@ -0,0 +1,190 @@
+/*
+ * Replay a trace (see trace.h) against the variant this is linked with:
+ *
+ *   cc -O2 -Ihost/include -Ihost -include sim.h \
+ *      f.c host/sim.c host/replay.c -o replay
+ *   ./replay [-l label] [-d] [-v] bench.vmt
+ *
+ * Every traced pid gets a simulated process the first time it shows up,
+ * except children, which are whatever do_cfork makes when the fork is
+ * replayed.  -d gives new processes the gemOS dummy vm_area head, for
+ * the variants that expect one.  The calls are made in trace order, so
+ * a replay is deterministic; results that differ from the traced ones
+ * are counted as mismatches (-v prints the first few).  If a fork that
+ * worked when traced fails on replay, the child's records are skipped.
+ *
+ * Output is tab separated, one row per op and one for all of them:
+ *
+ *   label op calls ns/op mismatches
+ *
+ * followed by a # line with the sim counters at the end of the replay
+ * and, if the variant has vm_area_fault_stats (vm_area.h), # lines with
+ * every process's fault classes added up: count, mean cycles and the
+ * log2 cycle histogram of each.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sim.h"
+#include "trace.h"
+
+#define REPLAY_PIDS   1024
+#define REPLAY_REPORT 10
+
+struct vm_fault_stats *vm_area_fault_stats(struct exec_context *current) __attribute__((weak));
+
+static const char *op_names[TRACE_NR_OPS] = {
+    [TRACE_MAP] = "map", [TRACE_UNMAP] = "unmap", [TRACE_MPROTECT] = "mprotect",
+    [TRACE_FAULT] = "fault", [TRACE_CFORK] = "cfork",
+};
+
+static struct {
+    u32 traced;
+    int lost;                           /* its fork failed on replay */
+    struct exec_context *ctx;
+} pids[REPLAY_PIDS];
+static u32 nr_pids;
+static int dummy_vma;
+
+static u64 now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static u32 pid_slot(u32 traced)
+{
+    for (u32 i = 0; i < nr_pids; i++)
+        if (pids[i].traced == traced) return i;
+    if (nr_pids == REPLAY_PIDS) {
+        fprintf(stderr, "replay: more than %d processes\n", REPLAY_PIDS);
+        exit(1);
+    }
+    pids[nr_pids].traced = traced;
+    return nr_pids++;
+}
+
+static struct exec_context *ctx_of(u32 traced)
+{
+    u32 i = pid_slot(traced);
+    if (!pids[i].ctx) {
+        pids[i].ctx = sim_new_process();
+        if (dummy_vma) sim_dummy_vma(pids[i].ctx);
+    }
+    return pids[i].ctx;
+}
+
+static long replay_one(struct trace_rec *r)
+{
+    struct exec_context *ctx = ctx_of(r->pid);
+    long ret;
+
+    /* every record runs as its own process: a handler that reads
+       get_current_ctx() must not see whichever pid ran last */
+    sim_set_current(ctx);
+    switch (r->op) {
+    case TRACE_MAP:
+        return vm_area_map(ctx, r->addr, (int)r->length, r->prot, r->flags);
+    case TRACE_UNMAP:
+        return vm_area_unmap(ctx, r->addr, (int)r->length);
+    case TRACE_MPROTECT:
+        return vm_area_mprotect(ctx, r->addr, (int)r->length, r->prot);
+    case TRACE_FAULT:
+        return vm_area_pagefault(ctx, r->addr, r->prot);
+    }
+    ret = do_cfork();
+    if (r->result > 0) {
+        u32 child = pid_slot(r->result);
+        pids[child].ctx = ret > 0 ? sim_ctx_by_pid(ret) : NULL;
+        pids[child].lost = ret <= 0;
+    }
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    const char *label = "f.c", *path = NULL;
+    int verbose = 0, rc;
+    u64 calls[TRACE_NR_OPS] = { 0 }, ns[TRACE_NR_OPS] = { 0 }, bad[TRACE_NR_OPS] = { 0 };
+    u64 records = 0, reported = 0, skipped = 0;
+    struct trace_file t = { 0 };
+    struct trace_rec r;
+    char magic[5] = { 0 };
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-l") && i + 1 < argc) label = argv[++i];
+        else if (!strcmp(argv[i], "-d")) dummy_vma = 1;
+        else if (!strcmp(argv[i], "-v")) verbose = 1;
+        else if (!path && argv[i][0] != '-') path = argv[i];
+        else path = NULL, i = argc;
+    }
+    if (!path) {
+        fprintf(stderr, "usage: %s [-l label] [-d] [-v] trace\n", argv[0]);
+        return 2;
+    }
+    if (!(t.f = fopen(path, "rb"))) {
+        perror(path);
+        return 1;
+    }
+    if (fread(magic, 1, 4, t.f) != 4 || strcmp(magic, TRACE_MAGIC) || fgetc(t.f) != TRACE_VERSION) {
+        fprintf(stderr, "replay: %s is not a version %d trace\n", path, TRACE_VERSION);
+        return 1;
+    }
+
+    while ((rc = trace_read(&t, &r)) > 0) {
+        records++;
+        if (pids[pid_slot(r.pid)].lost) {
+            skipped++;
+            continue;
+        }
+        u64 t0 = now_ns();
+        long ret = replay_one(&r);
+        ns[r.op] += now_ns() - t0;
+        calls[r.op]++;
+        /* child pids depend on the order contexts were handed out, only success counts */
+        if (r.op == TRACE_CFORK ? (ret > 0) != (r.result > 0) : ret != r.result) {
+            bad[r.op]++;
+            if (verbose && reported++ < REPLAY_REPORT)
+                printf("# mismatch at record %llu: %s pid %u addr %llx length %llx prot %x -> %ld, traced %ld\n",
+                       records, op_names[r.op], r.pid, r.addr, r.length, r.prot, ret, r.result);
+        }
+    }
+    if (rc < 0)
+        fprintf(stderr, "replay: %s is corrupt or truncated after %llu records\n", path, records);
+
+    for (int op = TRACE_MAP; op <= TRACE_NR_OPS; op++) {
+        u64 c = 0, n = 0, b = 0;
+        if (op < TRACE_NR_OPS) {
+            c = calls[op], n = ns[op], b = bad[op];
+        } else {
+            for (int i = TRACE_MAP; i < TRACE_NR_OPS; i++)
+                c += calls[i], n += ns[i], b += bad[i];
+        }
+        printf("%s\t%s\t%llu\t%.1f\t%llu\n", label, op < TRACE_NR_OPS ? op_names[op] : "all",
+               c, c ? (double)n / c : 0.0, b);
+    }
+    if (skipped)
+        printf("# %s: %llu records of processes whose fork failed were skipped\n", label, skipped);
+    printf("# %s: pfn allocs %llu, os allocs %llu, frames live %llu (peak %llu), invlpg %llu, flushes %llu\n",
+           label, sim.pfn_allocs, sim.os_allocs, sim.frames_live, sim.frames_peak, sim.invlpg, sim.tlb_flushes);
+    if (vm_area_fault_stats) {
+        static struct vm_fault_stats sum;
+        for (u32 i = 0; i < nr_pids; i++) {
+            struct vm_fault_stats *fs = pids[i].ctx ? vm_area_fault_stats(pids[i].ctx) : NULL;
+            if (!fs) continue;
+            for (int c = 0; c < FAULT_CLASSES; c++) {
+                sum.faults[c] += fs->faults[c];
+                sum.cycles[c] += fs->cycles[c];
+                for (int n = 0; n < FAULT_HIST_BUCKETS; n++)
+                    sum.hist[c][n] += fs->hist[c][n];
+            }
+            for (int n = 0; n < FAULT_PT_LEVELS; n++)
+                sum.pt_levels[n] += fs->pt_levels[n];
+        }
+        sim_print_fault_stats(label, &sum);
+    }
+    return rc < 0;
+}
@@ -0,0 +1,312 @@
+/*
+ * Host simulation of gemOS memory and context management, see sim.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <v2p.h>
+
+#include "sim.h"
+
+#define SIM_CTXS 64
+
+struct sim_counters sim;
+long sim_fail_after = -1;
+
+static struct vm_area_stats sim_stats;
+struct vm_area_stats *stats = &sim_stats;
+
+static unsigned char *arena;
+static s8 refcount[SIM_FRAMES];
+static u8 in_use[SIM_FRAMES];
+static u32 hint_user = 1, hint_pt = SIM_FRAMES / 2;
+
+static struct exec_context ctxs[SIM_CTXS];
+static u32 nr_ctxs;
+static struct exec_context *current_ctx;
+
+static void sim_init(void)
+{
+    if (arena) return;
+    /* one spare frame so the arena can start page aligned, the vector page kernels need it */
+    arena = calloc(SIM_FRAMES + 1, 4096);
+    if (!arena) {
+        fprintf(stderr, "sim: no memory for the %u frame arena\n", SIM_FRAMES);
+        abort();
+    }
+    arena += -(unsigned long)arena & 4095;
+}
+
+void *osmap(u64 pfn)
+{
+    sim_init();
+    if (pfn >= SIM_FRAMES) {
+        fprintf(stderr, "sim: osmap of bad pfn %llu\n", pfn);
+        abort();
+    }
+    return arena + pfn * 4096ULL;
+}
+
+/* lowest free frame at or above the region's hint, like a first-fit bitmap */
+u32 os_pfn_alloc(u32 region)
+{
+    sim_init();
+    if (sim_fail_after == 0) return 0;
+    if (sim_fail_after > 0) sim_fail_after--;
+
+    u32 lo = region == OS_PT_REG ? SIM_FRAMES / 2 : 0, span = SIM_FRAMES / 2;
+    u32 *hint = region == OS_PT_REG ? &hint_pt : &hint_user;
+    for (u32 n = 0; n < span; n++) {
+        u32 pfn = lo + (*hint - lo + n) % span;
+        if (pfn == 0 || in_use[pfn]) continue;
+        in_use[pfn] = 1;
+        refcount[pfn] = 1;
+        *hint = pfn + 1;
+        memset(arena + pfn * 4096ULL, 0, 4096);
+        sim.pfn_allocs++;
+        if (++sim.frames_live > sim.frames_peak) sim.frames_peak = sim.frames_live;
+        return pfn;
+    }
+    return 0;
+}
+
+void os_pfn_free(u32 region, u64 pfn)
+{
+    if (!pfn || pfn >= SIM_FRAMES || !in_use[pfn]) {
+        fprintf(stderr, "sim: bad os_pfn_free of %llu\n", pfn);
+        abort();
+    }
+    in_use[pfn] = 0;
+    refcount[pfn] = 0;
+    sim.frames_live--;
+    sim.pfn_frees++;
+    if (pfn < SIM_FRAMES / 2) {
+        if (pfn < hint_user) hint_user = pfn;
+    } else if (pfn < hint_pt) {
+        hint_pt = pfn;
+    }
+}
+
+/* some variants loop allocating forever; stop them before the host runs out */
+#define SIM_OS_ALLOC_MAX (1ULL << 24)
+
+void *os_alloc(u32 size)
+{
+    if (sim.os_allocs - sim.os_frees >= SIM_OS_ALLOC_MAX) {
+        fprintf(stderr, "sim: more than %llu live os_alloc objects\n", SIM_OS_ALLOC_MAX);
+        abort();
+    }
+    sim.os_allocs++;
+    return calloc(1, size);
+}
+
+void os_free(void *ptr, u32 size)
+{
+    sim.os_frees++;
+    free(ptr);
+}
+
+u64 get_pfn(u64 pfn)
+{
+    return ++refcount[pfn];
+}
+
+u64 put_pfn(u64 pfn)
+{
+    return --refcount[pfn];
+}
+
+s8 get_pfn_refcount(u64 pfn)
+{
+    return refcount[pfn];
+}
+
+int printk(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int r = vprintf(fmt, ap);
+    va_end(ap);
+    return r;
+}
+
+void sim_invlpg(u64 addr)
+{
+    sim.invlpg++;
+}
+
+void sim_flush_tlb(void)
+{
+    sim.tlb_flushes++;
+}
+
+struct exec_context *get_current_ctx(void)
+{
+    return current_ctx;
+}
+
+struct exec_context *get_new_ctx(void)
+{
+    if (nr_ctxs == SIM_CTXS) {
+        fprintf(stderr, "sim: out of contexts\n");
+        abort();
+    }
+    struct exec_context *ctx = &ctxs[nr_ctxs++];
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->pid = nr_ctxs;
+    return ctx;
+}
+
+void copy_os_pts(u64 src, u64 dst) {}
+void do_file_fork(struct exec_context *child) {}
+void setup_child_context(struct exec_context *child) {}
+
+/* a fresh process with an empty PGD, made current */
+struct exec_context *sim_new_process(void)
+{
+    struct exec_context *ctx = get_new_ctx();
+    ctx->pgd = os_pfn_alloc(OS_PT_REG);
+    current_ctx = ctx;
+    return ctx;
+}
+
+/* the dummy head node some variants expect to find already in place */
+void sim_dummy_vma(struct exec_context *ctx)
+{
+    struct vm_area *head = os_alloc(sizeof(*head));
+    head->vm_start = MMAP_AREA_START;
+    head->vm_end = MMAP_AREA_START + 4096;
+    head->access_flags = 0;
+    head->vm_next = NULL;
+    ctx->vm_area = head;
+    stats->num_vm_area = 1;
+}
+
+void sim_set_current(struct exec_context *ctx)
+{
+    current_ctx = ctx;
+}
+
+struct exec_context *sim_ctx_by_pid(u32 pid)
+{
+    for (u32 i = 0; i < nr_ctxs; i++)
+        if (ctxs[i].pid == pid) return &ctxs[i];
+    return NULL;
+}
+
+u64 *sim_leaf(struct exec_context *ctx, u64 va)
+{
+    u64 *table = osmap(ctx->pgd);
+    for (int level = 0; level < 4; level++) {
+        u64 *e = &table[(va >> (39 - 9 * level)) & 511];
+        if (!(*e & 1)) return NULL;
+        if (level == 3 || (level == 2 && (*e & 0x80))) return e;
+        table = osmap(*e >> 12);
+    }
+    return NULL;
+}
+
+u64 sim_frame(struct exec_context *ctx, u64 va)
+{
+    u64 *e = sim_leaf(ctx, va);
+    if (!e) return 0;
+    if (*e & 0x80) return (*e >> 12) + ((va >> 12) & 511);
+    return *e >> 12;
+}
+
+int sim_writable(struct exec_context *ctx, u64 va)
+{
+    u64 *table = osmap(ctx->pgd);
+    for (int level = 0; level < 4; level++) {
+        u64 *e = &table[(va >> (39 - 9 * level)) & 511];
+        if (!(*e & 1) || !(*e & SIM_PTE_W)) return 0;
+        if (level == 3 || (level == 2 && (*e & 0x80))) return 1;
+        table = osmap(*e >> 12);
+    }
+    return 0;
+}
+
+static u64 sim_pt_count(u64 pfn, int level, u64 base, u64 start, u64 end)
+{
+    u64 *table = osmap(pfn), n = 1;
+    int shift = 39 - 9 * level;
+    if (level == 3) return 1;
+    for (u64 i = 0; i < 512; i++) {
+        u64 lo = base + (i << shift), hi = lo + (1ULL << shift);
+        if (!(table[i] & 1) || hi <= start || lo >= end) continue;
+        if (level == 2 && (table[i] & 0x80)) continue;
+        n += sim_pt_count(table[i] >> 12, level + 1, lo, start, end);
+    }
+    return n;
+}
+
+/* counts the PGD and every table below it that covers part of [start, end) */
+u64 sim_pt_pages(struct exec_context *ctx, u64 start, u64 end)
+{
+    return sim_pt_count(ctx->pgd, 0, 0, start, end);
+}
+
+void sim_print_fault_stats(const char *prefix, const struct vm_fault_stats *fs)
+{
+    static const char *names[FAULT_CLASSES] = {
+        [FAULT_SPURIOUS] = "spurious", [FAULT_PAGE] = "page", [FAULT_ZERO] = "zero",
+        [FAULT_HUGE] = "huge", [FAULT_COW] = "cow", [FAULT_WP] = "wp",
+        [FAULT_INVALID] = "invalid", [FAULT_NOMEM] = "nomem",
+    };
+    for (int c = 0; c < FAULT_CLASSES; c++) {
+        if (!fs->faults[c]) continue;
+        printf("# %s fault %s: %llu, %.0f cycles mean, log2 cycles", prefix, names[c],
+               fs->faults[c], (double)fs->cycles[c] / fs->faults[c]);
+        for (int n = 0; n < FAULT_HIST_BUCKETS; n++)
+            if (fs->hist[c][n]) printf(" %d:%llu", n, fs->hist[c][n]);
+        printf("\n");
+    }
+    printf("# %s fault tables allocated: 0:%llu 1:%llu 2:%llu 3+:%llu\n", prefix,
+           fs->pt_levels[0], fs->pt_levels[1], fs->pt_levels[2], fs->pt_levels[3]);
+}
+
+u64 *get_user_pte(struct exec_context *ctx, u64 addr, int dump)
+{
+    u64 *table = osmap(ctx->pgd);
+    for (int level = 0; level < 4; level++) {
+        u64 *e = &table[(addr >> (39 - 9 * level)) & 511];
+        if (dump) printk("level %d entry %llx\n", level, *e);
+        if (level == 3) return e;
+        if (!(*e & 1) || (*e & 0x80)) return NULL;
+        table = osmap(*e >> 12);
+    }
+    return NULL;
+}
+
+/* entry points some variants leave out */
+__attribute__((weak)) long vm_area_map(struct exec_context *current, u64 addr, int length, int prot, int flags)
+{
+    return -1;
+}
+
+__attribute__((weak)) long vm_area_unmap(struct exec_context *current, u64 addr, int length)
+{
+    return -1;
+}
+
+__attribute__((weak)) long vm_area_mprotect(struct exec_context *current, u64 addr, int length, int prot)
+{
+    return -1;
+}
+
+__attribute__((weak)) long vm_area_pagefault(struct exec_context *current, u64 addr, int error_code)
+{
+    return -1;
+}
+
+__attribute__((weak)) long do_cfork(void)
+{
+    return -1;
+}
+
+__attribute__((weak)) long handle_cow_fault(struct exec_context *current, u64 vaddr, int access_flags)
+{
+    return -1;
+}
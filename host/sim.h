@@ -0,0 +1,72 @@
+/*
+ * Host simulation of the gemOS pieces the vm code calls into, so that
+ * f.c (or any of the other variants) runs unchanged as an ordinary
+ * Linux program:
+ *
+ *   cc -O2 -Ihost/include -Ihost -include sim.h f.c host/sim.c driver.c
+ *
+ * host/bench.c is such a driver; host/compare.sh builds it against
+ * every variant and lines the results up.  host/trace.h describes
+ * recording the calls a driver makes and replaying them (host/replay.c).
+ *
+ * Physical memory is an arena of SIM_FRAMES 4 KB frames with a refcount
+ * each.  USER_REG and OS_DS_REG frames come from the bottom half, as in
+ * gemOS OS_PT_REG frames come from a region of their own (the top
+ * half).  Contexts are a fixed table; get_new_ctx() hands out the next
+ * one, and the copy_os_pts/do_file_fork/setup_child_context tail of
+ * do_cfork does nothing.  invlpg and CR3 reloads are counted, not
+ * executed.
+ *
+ * Forcing sim.h in with -include gives every variant the entry point
+ * prototypes its own code calls before defining them, as gemOS does
+ * through mmap.h.  Variants that don't implement one of the entry
+ * points still link: the missing ones come from weak stubs in sim.c
+ * that return -1.
+ */
+#ifndef __SIM_H_
+#define __SIM_H_
+
+#include <types.h>
+#include <mmap.h>
+#include <fork.h>
+
+#include "../vm_area.h"
+
+#define SIM_FRAMES (1u << 18)          /* 1 GB of simulated memory */
+
+#ifndef SIM_PTE_W
+#define SIM_PTE_W 0x8                   /* the variant's R/W bit: 0x8 in f.c, x86's 0x2 in most others */
+#endif
+
+struct sim_counters {
+    u64 frames_live;                    /* frames handed out by os_pfn_alloc, not yet freed */
+    u64 frames_peak;
+    u64 pfn_allocs;
+    u64 pfn_frees;
+    u64 os_allocs;                      /* os_alloc/os_free calls */
+    u64 os_frees;
+    u64 invlpg;
+    u64 tlb_flushes;                    /* CR3 reloads */
+};
+
+extern struct sim_counters sim;
+extern long sim_fail_after;            /* os_pfn_alloc fails after this many more calls; -1 never */
+
+struct exec_context *sim_new_process(void);
+/* give ctx the dummy vm_area head; f.c and part1.c make their own on the first mmap */
+void sim_dummy_vma(struct exec_context *ctx);
+void sim_set_current(struct exec_context *ctx);
+struct exec_context *sim_ctx_by_pid(u32 pid);
+
+/* leaf entry mapping va (a 4 KB PTE or a 2 MB PMD), NULL if none */
+u64 *sim_leaf(struct exec_context *ctx, u64 va);
+/* pfn backing va, 0 if not mapped */
+u64 sim_frame(struct exec_context *ctx, u64 va);
+/* a write to va would not fault: mapped, with SIM_PTE_W at every level */
+int sim_writable(struct exec_context *ctx, u64 va);
+/* frames currently allocated in the page tables under [start, end) */
+u64 sim_pt_pages(struct exec_context *ctx, u64 start, u64 end);
+/* "# prefix ..." lines with the per-class fault counts, mean cycles and log2 histogram */
+void sim_print_fault_stats(const char *prefix, const struct vm_fault_stats *fs);
+
+#endif
@@ -0,0 +1,81 @@
+/*
+ * Trace capture, see trace.h.  The entry points are wrapped at link
+ * time, so every call a driver makes into the variant goes through
+ * here; calls the variant makes to itself don't, which is what we want.
+ * Nothing is recorded unless VM_TRACE names a file.
+ */
+#include <stdlib.h>
+
+#include "sim.h"
+#include "trace.h"
+
+long __real_vm_area_map(struct exec_context *current, u64 addr, int length, int prot, int flags);
+long __real_vm_area_unmap(struct exec_context *current, u64 addr, int length);
+long __real_vm_area_mprotect(struct exec_context *current, u64 addr, int length, int prot);
+long __real_vm_area_pagefault(struct exec_context *current, u64 addr, int error_code);
+long __real_do_cfork(void);
+
+static struct trace_file trace;
+static int trace_state;                 /* 0 not looked at VM_TRACE yet, 1 recording, -1 off */
+
+static void trace_close(void)
+{
+    fclose(trace.f);
+}
+
+static void trace_emit(struct trace_rec *r)
+{
+    if (!trace_state) {
+        const char *path = getenv("VM_TRACE");
+        trace_state = -1;
+        if (path && (trace.f = fopen(path, "wb"))) {
+            fwrite(TRACE_MAGIC, 1, 4, trace.f);
+            fputc(TRACE_VERSION, trace.f);
+            atexit(trace_close);
+            trace_state = 1;
+        } else if (path) {
+            fprintf(stderr, "trace: cannot write %s\n", path);
+        }
+    }
+    if (trace_state > 0) trace_write(&trace, r);
+}
+
+long __wrap_vm_area_map(struct exec_context *current, u64 addr, int length, int prot, int flags)
+{
+    struct trace_rec r = { TRACE_MAP, current->pid, addr, (u64)length, prot, flags };
+    r.result = __real_vm_area_map(current, addr, length, prot, flags);
+    trace_emit(&r);
+    return r.result;
+}
+
+long __wrap_vm_area_unmap(struct exec_context *current, u64 addr, int length)
+{
+    struct trace_rec r = { TRACE_UNMAP, current->pid, addr, (u64)length };
+    r.result = __real_vm_area_unmap(current, addr, length);
+    trace_emit(&r);
+    return r.result;
+}
+
+long __wrap_vm_area_mprotect(struct exec_context *current, u64 addr, int length, int prot)
+{
+    struct trace_rec r = { TRACE_MPROTECT, current->pid, addr, (u64)length, prot };
+    r.result = __real_vm_area_mprotect(current, addr, length, prot);
+    trace_emit(&r);
+    return r.result;
+}
+
+long __wrap_vm_area_pagefault(struct exec_context *current, u64 addr, int error_code)
+{
+    struct trace_rec r = { TRACE_FAULT, current->pid, addr, 0, error_code };
+    r.result = __real_vm_area_pagefault(current, addr, error_code);
+    trace_emit(&r);
+    return r.result;
+}
+
+long __wrap_do_cfork(void)
+{
+    struct trace_rec r = { TRACE_CFORK, get_current_ctx()->pid };
+    r.result = __real_do_cfork();
+    trace_emit(&r);
+    return r.result;
+}
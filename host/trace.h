@@ -0,0 +1,159 @@
+/*
+ * Binary traces of vm_area_map/unmap/mprotect, page faults and do_cfork.
+ *
+ * Capture: link host/trace.c into any host build with the entry points
+ * wrapped, and name the output file in VM_TRACE:
+ *
+ *   cc -O2 -Ihost/include -Ihost -include sim.h \
+ *      f.c host/sim.c host/trace.c host/bench.c -o bench \
+ *      -Wl,--wrap=vm_area_map,--wrap=vm_area_unmap,--wrap=vm_area_mprotect \
+ *      -Wl,--wrap=vm_area_pagefault,--wrap=do_cfork
+ *   VM_TRACE=bench.vmt ./bench
+ *
+ * That only sees calls a host driver makes.  A workload running on
+ * gemOS is captured by the variant itself: vm_area_trace_start
+ * (vm_area.h) records every entry point call of the context and the
+ * children it cforks into a ring of kernel pages, and
+ * vm_area_trace_read drains it as struct vm_trace_rec, the fields of
+ * struct trace_rec with the same op numbers; the tracer writes them
+ * out with trace_write.  bench -t does the same on the host, and gives
+ * the file the wrappers give.
+ *
+ * Replay: host/replay.c drives the same calls against whatever variant
+ * it is linked with (see there).
+ *
+ * The file is the TRACE_MAGIC bytes and a version byte, then one record
+ * per call: an op byte, the caller's pid and the arguments and result.
+ * Numbers are LEB128 varints; addresses are stored as the zigzagged
+ * difference from the previous address in the trace, and results as
+ * the zigzagged difference from the address they would normally return
+ * (the hint for map, 0 for the others), so a typical record is a few
+ * bytes.  Results are kept so replay can tell where an implementation
+ * behaves differently from the one that was traced.
+ */
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+#include <stdio.h>
+
+#include <types.h>
+
+#define TRACE_MAGIC   "VMTR"
+#define TRACE_VERSION 1
+
+enum trace_op {
+    TRACE_MAP = 1,      /* pid addr length prot flags result */
+    TRACE_UNMAP,        /* pid addr length result */
+    TRACE_MPROTECT,     /* pid addr length prot result */
+    TRACE_FAULT,        /* pid addr error_code result */
+    TRACE_CFORK,        /* pid result (the child's pid) */
+    TRACE_NR_OPS
+};
+
+struct trace_rec {
+    u32 op;
+    u32 pid;
+    u64 addr;
+    u64 length;
+    u32 prot;           /* prot, or the error code of a fault */
+    u32 flags;
+    long result;
+};
+
+/* the per-file state both directions need to undo the deltas */
+struct trace_file {
+    FILE *f;
+    u64 last_addr;
+};
+
+static inline void trace_put_uv(FILE *f, u64 v)
+{
+    while (v >= 0x80) {
+        fputc((v & 0x7f) | 0x80, f);
+        v >>= 7;
+    }
+    fputc(v, f);
+}
+
+static inline void trace_put_sv(FILE *f, long v)
+{
+    trace_put_uv(f, ((u64)v << 1) ^ (u64)(v >> 63));
+}
+
+/* returns -1 on a truncated varint */
+static inline int trace_get_uv(FILE *f, u64 *v)
+{
+    int c, shift = 0;
+    *v = 0;
+    do {
+        if ((c = fgetc(f)) == EOF || shift > 63) return -1;
+        *v |= (u64)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return 0;
+}
+
+static inline int trace_get_sv(FILE *f, long *v)
+{
+    u64 u;
+    if (trace_get_uv(f, &u)) return -1;
+    *v = (long)(u >> 1) ^ -(long)(u & 1);
+    return 0;
+}
+
+static inline long trace_result_base(struct trace_rec *r)
+{
+    return r->op == TRACE_MAP ? (long)r->addr : 0;
+}
+
+static inline void trace_write(struct trace_file *t, struct trace_rec *r)
+{
+    fputc(r->op, t->f);
+    trace_put_uv(t->f, r->pid);
+    if (r->op != TRACE_CFORK) {
+        trace_put_sv(t->f, (long)(r->addr - t->last_addr));
+        t->last_addr = r->addr;
+    }
+    if (r->op == TRACE_MAP || r->op == TRACE_UNMAP || r->op == TRACE_MPROTECT)
+        trace_put_uv(t->f, r->length);
+    if (r->op != TRACE_UNMAP && r->op != TRACE_CFORK)
+        trace_put_uv(t->f, r->prot);
+    if (r->op == TRACE_MAP)
+        trace_put_uv(t->f, r->flags);
+    trace_put_sv(t->f, r->result - trace_result_base(r));
+}
+
+/* 1 for a record, 0 at the end of the trace, -1 if it is corrupt */
+static inline int trace_read(struct trace_file *t, struct trace_rec *r)
+{
+    u64 v;
+    long d;
+    int c = fgetc(t->f);
+
+    if (c == EOF) return 0;
+    if (c <= 0 || c >= TRACE_NR_OPS) return -1;
+    r->op = c;
+    r->addr = r->length = r->prot = r->flags = 0;
+    if (trace_get_uv(t->f, &v)) return -1;
+    r->pid = v;
+    if (r->op != TRACE_CFORK) {
+        if (trace_get_sv(t->f, &d)) return -1;
+        r->addr = t->last_addr += d;
+    }
+    if (r->op == TRACE_MAP || r->op == TRACE_UNMAP || r->op == TRACE_MPROTECT) {
+        if (trace_get_uv(t->f, &r->length)) return -1;
+    }
+    if (r->op != TRACE_UNMAP && r->op != TRACE_CFORK) {
+        if (trace_get_uv(t->f, &v)) return -1;
+        r->prot = v;
+    }
+    if (r->op == TRACE_MAP) {
+        if (trace_get_uv(t->f, &v)) return -1;
+        r->flags = v;
+    }
+    if (trace_get_sv(t->f, &d)) return -1;
+    r->result = d + trace_result_base(r);
+    return 1;
+}
+
+#endif
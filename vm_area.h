@@ -0,0 +1,148 @@
+/*
+ * Entry points f.c adds next to the vm_area_* calls mmap.h declares:
+ * per-context teardown and tuning, the counters and fault statistics,
+ * the pre-zeroed frame pools and contiguous runs from the buddy
+ * allocator.  All of them take the context whose mmap window they act
+ * on.
+ */
+#ifndef __VM_AREA_H_
+#define __VM_AREA_H_
+
+#include <types.h>
+#include <context.h>
+
+/* 4 KB zero/copy kernels, picked from CPUID when the context is set up */
+#define PAGE_OPS_LOOP 0                         /* plain C, the reference */
+#define PAGE_OPS_REP  1                         /* rep stosq / rep movsq */
+#define PAGE_OPS_SSE2 2                         /* movdqa, 16 bytes a store */
+#define PAGE_OPS_AVX2 3                         /* vmovdqa, 32 bytes a store */
+#define PAGE_OPS_NT   4                         /* movnti, bypasses the cache */
+#define PAGE_OPS_NR   5
+
+/* vm_area_pagefault outcomes, see vm_area_fault_stats */
+#define FAULT_SPURIOUS 0                        /* already mapped, nothing to do */
+#define FAULT_PAGE     1                        /* new 4 KB frame */
+#define FAULT_ZERO     2                        /* read, mapped the zero page */
+#define FAULT_HUGE     3                        /* new 2 MB page */
+#define FAULT_COW      4                        /* private copy of a shared frame */
+#define FAULT_WP       5                        /* only W had to be set */
+#define FAULT_INVALID  6                        /* no VMA, or an access it doesn't allow */
+#define FAULT_NOMEM    7                        /* out of frames */
+#define FAULT_CLASSES  8
+#define FAULT_HIST_BUCKETS 32                   /* log2 of TSC cycles */
+#define FAULT_PT_LEVELS    4                    /* 0, 1, 2, 3 or more tables per fault */
+
+/* vm_trace_rec ops, numbered as in host/trace.h */
+#define VM_TRACE_MAP      1                     /* pid addr length prot flags result */
+#define VM_TRACE_UNMAP    2                     /* pid addr length result */
+#define VM_TRACE_MPROTECT 3                     /* pid addr length prot result */
+#define VM_TRACE_FAULT    4                     /* pid addr error_code result */
+#define VM_TRACE_CFORK    5                     /* pid result (the child's pid) */
+
+/* runs of 2^order frames, order 0 (4 KB) to 9 (2 MB) */
+#define BUDDY_ORDERS    10
+
+struct vm_counters {
+    u64 vmacache_hits;
+    u64 vmacache_misses;
+    u64 vm_nodes_active;                /* real VMAs, i.e. stats->num_vm_area - 1 */
+    u64 vm_nodes_free;                  /* cached on the free list */
+    u64 vm_slabs;
+    u64 small_pages;                    /* live 4 KB user mappings */
+    u64 huge_pages;                     /* live 2 MB user mappings */
+    u64 huge_splits;
+    u64 huge_fallbacks;                 /* no contiguous run, fell back to 4 KB */
+    u64 fault_around_pages;             /* neighbours mapped ahead of use */
+    u64 pt_pages_live;                  /* page-table pages held under the mmap window */
+    u64 pt_pages_reclaimed;             /* emptied by munmap and given back */
+    u64 tlb_invlpg;                     /* single-page invalidations */
+    u64 tlb_full_flushes;               /* CR3 reloads */
+    u64 mprotect_lazy;                  /* upgrades that left the PTEs alone */
+    u64 wp_promotions;                  /* write faults that only had to set W */
+    u64 zero_pool_depth;                /* zeroed frames parked, both regions */
+    u64 zero_pool_hits;
+    u64 zero_pool_misses;               /* pool empty, refilled from os_pfn_alloc */
+    u64 zero_pool_zeroed;               /* frames zeroed off the fault path */
+    u64 zero_pool_refills;              /* batches taken from os_pfn_alloc */
+    u64 zero_pool_refill_frames;
+    u64 zero_pool_trims;                /* batches given back to os_pfn_free */
+    u64 zero_pool_trim_frames;
+    u64 zero_page_maps;                 /* PTEs on the zero page, i.e. frames saved */
+    u64 zero_page_cow;                  /* writes that replaced it with a real frame */
+    u64 buddy_arenas;                   /* 2 MB arenas owned by the buddy allocator, */
+    u64 buddy_free_pages;               /* shared with cfork relatives */
+    u64 buddy_free_blocks[BUDDY_ORDERS];
+    u64 buddy_grabs;                    /* arenas collected with huge_frame_grab */
+    u64 buddy_splits;
+    u64 buddy_merges;
+    u64 buddy_alloc_fails;              /* no free block and no new arena */
+    u64 trace_dropped;                  /* records that found the trace ring full */
+};
+
+/*
+ * Fault accounting, kept for the life of the context.  hist[c][n] counts
+ * faults of class c that took 2^n to 2^(n+1) - 1 TSC cycles from entry
+ * to return (the last bucket takes everything longer).  pt_levels[n]
+ * counts faults that allocated n page table pages on the way down,
+ * counting PTE tables made by splitting a 2 MB page or unsharing a
+ * cfork table.
+ */
+struct vm_fault_stats {
+    u64 faults[FAULT_CLASSES];
+    u64 cycles[FAULT_CLASSES];          /* sum, for the mean */
+    u64 hist[FAULT_CLASSES][FAULT_HIST_BUCKETS];
+    u64 pt_levels[FAULT_PT_LEVELS];
+};
+
+/*
+ * Teardown, for the exit path: unmaps the window and frees everything
+ * the context's vm index holds, the index included, leaving
+ * current->vm_area NULL.  VMAs come from per-context slabs, so the exit
+ * path must call this before it looks at current->vm_area and must
+ * never os_free a vm_area itself.  Safe on a context that never mapped
+ * anything.
+ */
+void vm_area_exit(struct exec_context *current);
+
+/* one entry point call, as vm_area_trace_read hands it out */
+struct vm_trace_rec {
+    u32 op;                             /* VM_TRACE_* */
+    u32 pid;                            /* the calling context */
+    u64 addr;
+    u64 length;
+    u32 prot;                           /* prot, or the error code of a fault */
+    u32 flags;
+    long result;
+};
+
+/* tuning; 0, -EINVAL for a value out of range, -ENOMEM if the context can't be set up */
+long vm_area_set_fault_around(struct exec_context *current, u64 pages);
+long vm_area_set_tlb_threshold(struct exec_context *current, u64 pages);
+long vm_area_set_page_ops(struct exec_context *current, u64 zero_op, u64 copy_op);
+
+/* NULL before the context's first mmap (and, for the stats, its first fault) */
+struct vm_counters *vm_area_counters(struct exec_context *current);
+struct vm_fault_stats *vm_area_fault_stats(struct exec_context *current);
+
+/* pre-zeroed frame pools, for idle time */
+long vm_area_zero_pool_refill(struct exec_context *current, u64 frames);
+void vm_area_zero_pool_drain(struct exec_context *current);
+
+/*
+ * Trace capture of a live workload.  start gives the context, and the
+ * children it cforks afterwards, a ring of pages OS_DS_REG pages (0,
+ * -EINVAL or -ENOMEM like the tuning calls).  read moves up to max
+ * records into a kernel buffer, oldest first, and returns how many, or
+ * -EINVAL if the context isn't tracing; a syscall copies them out to
+ * the tracer.
+ */
+long vm_area_trace_start(struct exec_context *current, u64 pages);
+long vm_area_trace_read(struct exec_context *current, struct vm_trace_rec *buf, u64 max);
+void vm_area_trace_stop(struct exec_context *current);
+
+/* contiguous, zeroed USER_REG runs */
+u64 vm_area_alloc_run(struct exec_context *current, u64 order);
+long vm_area_free_run(struct exec_context *current, u64 pfn, u64 order);
+long vm_area_buddy_unusable(struct exec_context *current, u64 order);
+
+#endif